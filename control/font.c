@@ -1,7 +1,12 @@
+#include <sys/stat.h>
+
 #include <err.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <unistd.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
@@ -10,9 +15,14 @@
 
 #include <control/font.h>
 
+#define NASCII 128
+
 struct FntPatt {
 	XftFont        *xftfont;
 	FcPattern      *pattern;
+	FcCharSet      *charset;        /* owned by xftfont, may be NULL */
+	short           advance[NASCII];        /* -1 if the font lacks it */
+	FT_UInt         glyph[NASCII];
 };
 
 struct VArray {
@@ -21,6 +31,37 @@ struct VArray {
 	size_t          nmemb;
 };
 
+struct Glyph {
+	struct Glyph   *next;
+	FcChar32        glyph;
+	unsigned short  font;
+};
+
+struct Fallback {
+	struct Fallback *next;
+	unsigned long   block;          /* codepoint >> FALLBACK_SHIFT */
+	int             index;          /* face index within the file */
+	int             ascent;         /* metrics of the font when found, */
+	FcChar32        glyph;          /* and the advance of the glyph */
+	int             advance;        /* it was found for */
+	char            file[];
+};
+
+struct DrawOrder {
+	Picture         src;
+	size_t          first;          /* first text drawn with src */
+	size_t          index;
+};
+
+#define MAXGLYPHS 1024
+#define GLYPH_BUCKETS 256
+#define NBMPGLYPHS 0x10000
+#define GLYPH_UNKNOWN 0x0000    /* not looked up yet */
+#define GLYPH_MISSING 0xFFFF    /* in no font; drawn with the first one */
+#define FALLBACK_SHIFT 8        /* codepoints per cached fallback block */
+#define GLYPH_BLOCK 0x100       /* BMP glyphs resolved together */
+#define MAXELLIPSIS 3           /* "..." if no font has U+2026 */
+
 struct ctrlfnt {
 	Display        *display;
 	int             screen;
@@ -29,16 +70,91 @@ struct ctrlfnt {
 	struct VArray  *xft_fontset;
 	XFontSet        xlfd_fontset;
 	XFontStruct    *xlfd_font;
+
+	/* index plus one of the font drawing each glyph, or GLYPH_* */
+	unsigned short *bmpfonts;
+	struct Glyph   *astralfonts[GLYPH_BUCKETS];
+
+	/* layout glyphs moved into place for drawing */
+	XftGlyphFontSpec *specs;
+	size_t          specsize;
+
+	/* ending of cut strings; ellipsisw is -1 until first needed */
+	XftGlyphFontSpec ellipsis[MAXELLIPSIS];
+	size_t          nellipsis;
+	int             ellipsisw;
+
+	/* fallback fonts found in earlier runs; see ctrlfnt_cache() */
+	unsigned long   key;            /* hash of the font spec and size */
+	char           *cachedir;
+	char           *cachepath;
+	struct Fallback *fallbacks;
+	int             cachedirty;
+
+	/* mask core fonts are drawn on, grown to the largest string drawn */
+	Pixmap          scratch;
+	Picture         scratchmask;
+	GC              scratchgc;
+	int             scratchw, scratchh;
+};
+
+struct ctrlfnt_layout {
+	ctrlfnt        *fontset;
+	int             width;
+
+	/*
+	 * Xft fontsets: the glyph of each character in the font drawing it,
+	 * positioned relative to the middle of the line; where each glyph
+	 * starts, relative to the start of the string, is kept apart as an
+	 * int, for the x of a glyph spec is a short.
+	 */
+	XftGlyphFontSpec *specs;
+	int            *advance;
+	size_t          nspecs;
+
+	/* core fonts: the string itself, redrawn from scratch each time */
+	char           *text;
+	int             nbytes;
 };
 
-#define MAXGLYPHS 1024
 #define BETWEEN(x, a, b)    ((a) <= (x) && (x) <= (b))
 
 static size_t font_count = 0;
 
+static int
+hasglyph(Display *display, struct FntPatt *font, FcChar32 glyph)
+{
+	if (font->charset != NULL)
+		return FcCharSetHasChar(font->charset, glyph);
+	return XftCharExists(display, font->xftfont, glyph);
+}
+
+static void
+initfont(Display *display, struct FntPatt *font)
+{
+	XGlyphInfo extents;
+
+	/* keep the coverage at hand so lookups need not go through Xft */
+	font->charset = font->xftfont->charset;
+	if (font->charset == NULL &&
+	    FcPatternGetCharSet(font->pattern, FC_CHARSET, 0,
+	                        &font->charset) != FcResultMatch)
+		font->charset = NULL;
+	for (FcChar32 c = 0; c < NASCII; c++) {
+		font->advance[c] = -1;
+		font->glyph[c] = 0;
+		if (!hasglyph(display, font, c))
+			continue;
+		font->glyph[c] = XftCharIndex(display, font->xftfont, c);
+		XftGlyphExtents(display, font->xftfont, &font->glyph[c], 1, &extents);
+		font->advance[c] = extents.xOff;
+	}
+}
+
 static struct FntPatt
 openxftfont(Display *display, const char *fontname, double fontsize)
 {
+	struct FntPatt retfont;
 	FcPattern *pattern = NULL;
 	FcPattern *match = NULL;
 	FcResult result;
@@ -54,10 +170,12 @@ openxftfont(Display *display, const char *fontname, double fontsize)
 	if ((font = XftFontOpenPattern(display, match)) == NULL)
 		goto error;
 	FcPatternDestroy(pattern);
-	return (struct FntPatt){
+	retfont = (struct FntPatt){
 		.xftfont = font,
 		.pattern = match,
 	};
+	initfont(display, &retfont);
+	return retfont;
 error:
 	warnx("%s: could not open font", fontname);
 	if (pattern != NULL)
@@ -226,86 +344,438 @@ getnextutf8char(const char *s, const char **next_ret)
 	return ucode;
 }
 
-static struct FntPatt
-opennewfont(ctrlfnt *fontset, FcChar32 glyph)
+static size_t
+decodeutf8(FcChar32 *glyphs, const char *text, int nbytes)
+{
+	const char *s = text;
+	const char *end = text + nbytes;
+	size_t nglyphs = 0;
+
+	while (s < end) {
+		if ((unsigned char)*s < 0x80)
+			glyphs[nglyphs++] = (unsigned char)*s++;
+		else
+			glyphs[nglyphs++] = getnextutf8char(s, &s);
+	}
+	return nglyphs;
+}
+
+static int
+addfallback(ctrlfnt *fontset, struct Fallback *entry, const char *file)
+{
+	struct Fallback *fallback;
+	size_t len;
+
+	for (fallback = fontset->fallbacks; fallback != NULL; fallback = fallback->next)
+		if (fallback->block == entry->block &&
+		    fallback->index == entry->index &&
+		    strcmp(fallback->file, file) == 0)
+			return 0;
+	len = strlen(file) + 1;
+	if ((fallback = malloc(sizeof(*fallback) + len)) == NULL)
+		return -1;
+	*fallback = *entry;
+	memcpy(fallback->file, file, len);
+	fallback->next = fontset->fallbacks;
+	fontset->fallbacks = fallback;
+	return 0;
+}
+
+static void
+freefallbacks(ctrlfnt *fontset)
 {
-	struct FntPatt retfont = fontset->xft_fontset->fonts[0];
+	struct Fallback *fallback, *next;
+
+	for (fallback = fontset->fallbacks; fallback != NULL; fallback = next) {
+		next = fallback->next;
+		free(fallback);
+	}
+	fontset->fallbacks = NULL;
+}
+
+static void
+loadfallbacks(ctrlfnt *fontset)
+{
+	struct Fallback entry;
+	FILE *fp;
+	char line[PATH_MAX + 64];
+	unsigned long glyph;
+	size_t len;
+	int n;
+
+	if ((fp = fopen(fontset->cachepath, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		if (len == 0 || line[len - 1] != '\n')
+			continue;
+		line[len - 1] = '\0';
+		n = 0;
+		if (sscanf(line, "%lx %d %d %lx %d %n", &entry.block,
+		           &entry.index, &entry.ascent, &glyph,
+		           &entry.advance, &n) != 5 || n == 0)
+			continue;
+		if (line[n] != '/')
+			continue;
+		entry.glyph = glyph;
+		if (addfallback(fontset, &entry, line + n) == -1)
+			break;
+	}
+	fclose(fp);
+}
+
+static void
+savefallbacks(ctrlfnt *fontset)
+{
+	struct Fallback *fallback;
+	FILE *fp;
+	char tmp[PATH_MAX];
+	int fd, n;
+
+	if (fontset->cachepath == NULL || !fontset->cachedirty)
+		return;
+	(void)mkdir(fontset->cachedir, 0700);
+	n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fontset->cachepath);
+	if (n < 0 || (size_t)n >= sizeof(tmp))
+		return;
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto error;
+	}
+	for (fallback = fontset->fallbacks; fallback != NULL; fallback = fallback->next)
+		fprintf(
+			fp, "%lx %d %d %lx %d %s\n",
+			fallback->block,
+			fallback->index,
+			fallback->ascent,
+			(unsigned long)fallback->glyph,
+			fallback->advance,
+			fallback->file
+		);
+	if (fclose(fp) == EOF)
+		goto error;
+	if (rename(tmp, fontset->cachepath) == -1)
+		goto error;
+	fontset->cachedirty = 0;
+	return;
+error:
+	(void)unlink(tmp);
+}
+
 #ifndef CTRLFNT_NO_SEARCH
-	struct FntPatt font = { NULL, NULL };
-	FcCharSet *fccharset = NULL;
-	FcPattern *fcpattern = NULL;
-	XftResult result;
+static int
+glyphadvance(Display *display, XftFont *font, FcChar32 glyph)
+{
+	XGlyphInfo extents;
+	FT_UInt index;
 
+	index = XftCharIndex(display, font, glyph);
+	XftGlyphExtents(display, font, &index, 1, &extents);
+	return extents.xOff;
+}
+
+static FcPattern *
+fallbackpattern(ctrlfnt *fontset, FcChar32 glyph)
+{
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+
+	/*
+	 * The request for a font covering the glyph, substituted just
+	 * as XftFontMatch() would: both a search and a cached fallback
+	 * open their font from it, so they come at the same size.
+	 */
 	if ((fccharset = FcCharSetCreate()) == NULL)
-		goto done;
-	if (!FcCharSetAddChar(fccharset, glyph))
-		goto done;
+		return NULL;
 	if ((fcpattern = FcPatternCreate()) == NULL)
-		goto done;
+		goto error;
+	if (!FcCharSetAddChar(fccharset, glyph))
+		goto error;
 	if (!FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset))
-		goto done;
+		goto error;
 	if (!FcConfigSubstitute(NULL, fcpattern, FcMatchPattern))
-		goto done;
+		goto error;
 	FcDefaultSubstitute(fcpattern);
-	font.pattern = XftFontMatch(
+	XftDefaultSubstitute(fontset->display, fontset->screen, fcpattern);
+	FcCharSetDestroy(fccharset);
+	return fcpattern;
+error:
+	if (fcpattern != NULL)
+		FcPatternDestroy(fcpattern);
+	FcCharSetDestroy(fccharset);
+	return NULL;
+}
+
+static struct FntPatt
+openfallback(ctrlfnt *fontset, FcPattern *request, const char *file, int index)
+{
+	struct FntPatt font = { .xftfont = NULL, .pattern = NULL };
+
+	/* Xft computes the coverage of the face itself without a charset */
+	if ((font.pattern = FcPatternDuplicate(request)) == NULL)
+		return font;
+	(void)FcPatternDel(font.pattern, FC_CHARSET);
+	if (FcPatternAddString(font.pattern, FC_FILE, (const FcChar8 *)file) &&
+	    FcPatternAddInteger(font.pattern, FC_INDEX, index))
+		font.xftfont = XftFontOpenPattern(fontset->display, font.pattern);
+	if (font.xftfont == NULL) {
+		FcPatternDestroy(font.pattern);
+		font.pattern = NULL;
+	}
+	return font;
+}
+
+static void
+closefallback(ctrlfnt *fontset, struct FntPatt *font)
+{
+	if (font->xftfont != NULL)
+		XftFontClose(fontset->display, font->xftfont);
+	else if (font->pattern != NULL)
+		FcPatternDestroy(font->pattern);
+	*font = (struct FntPatt){ .xftfont = NULL, .pattern = NULL };
+}
+
+static struct FntPatt
+opencachedfont(ctrlfnt *fontset, FcPattern *request, FcChar32 glyph)
+{
+	struct Fallback *fallback, **prev;
+	struct FntPatt font = { .xftfont = NULL, .pattern = NULL };
+
+	prev = &fontset->fallbacks;
+	while ((fallback = *prev) != NULL) {
+		if (fallback->block != glyph >> FALLBACK_SHIFT) {
+			prev = &fallback->next;
+			continue;
+		}
+
+		/*
+		 * Open the file from the same request a search would open
+		 * it from, skipping the FcFontMatch of opennewfont().  A
+		 * font that is gone, or no longer has the metrics it had
+		 * when found (the file or the configuration changed), is
+		 * forgotten.
+		 */
+		font = openfallback(fontset, request, fallback->file, fallback->index);
+		if (font.xftfont == NULL ||
+		    font.xftfont->ascent != fallback->ascent ||
+		    glyphadvance(fontset->display, font.xftfont,
+		                 fallback->glyph) != fallback->advance) {
+			closefallback(fontset, &font);
+			*prev = fallback->next;
+			free(fallback);
+			fontset->cachedirty = 1;
+			continue;
+		}
+		if (XftCharExists(fontset->display, font.xftfont, glyph))
+			return font;
+		closefallback(fontset, &font);
+		prev = &fallback->next;
+	}
+	return font;
+}
+
+static void
+cachefont(ctrlfnt *fontset, FcChar32 glyph, XftFont *xftfont,
+          const char *file, int index)
+{
+	struct Fallback entry = {
+		.block = glyph >> FALLBACK_SHIFT,
+		.index = index,
+		.ascent = xftfont->ascent,
+		.glyph = glyph,
+		.advance = glyphadvance(fontset->display, xftfont, glyph),
+	};
+
+	if (fontset->cachepath == NULL)
+		return;
+	if (addfallback(fontset, &entry, file) == 0)
+		fontset->cachedirty = 1;
+}
+#endif /* CTRLFNT_NO_SEARCH */
+
+static int
+opennewfont(ctrlfnt *fontset, FcChar32 glyph)
+{
+	int retval = -1;
+#ifndef CTRLFNT_NO_SEARCH
+	struct FntPatt font = { .xftfont = NULL, .pattern = NULL };
+	FcPattern *request = NULL;
+	FcPattern *match = NULL;
+	FcChar8 *file;
+	XftResult result;
+	int index = 0;
+
+	if ((request = fallbackpattern(fontset, glyph)) == NULL)
+		goto done;
+	font = opencachedfont(fontset, request, glyph);
+	if (font.xftfont != NULL)
+		goto found;
+
+	/* only the file and face are taken from the match */
+	match = XftFontMatch(
 		fontset->display,
 		fontset->screen,
-		fcpattern,
+		request,
 		&result
 	);
-	if (font.pattern == NULL)
+	if (match == NULL)
+		goto done;
+	if (FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch)
 		goto done;
-	font.xftfont = XftFontOpenPattern(fontset->display, font.pattern);
+	(void)FcPatternGetInteger(match, FC_INDEX, 0, &index);
+	font = openfallback(fontset, request, (char *)file, index);
 	if (font.xftfont == NULL)
 		goto done;
 	if (XftCharExists(fontset->display, font.xftfont, glyph) == FcFalse)
 		goto done;
+	cachefont(fontset, glyph, font.xftfont, (char *)file, index);
+found:
+	initfont(fontset->display, &font);
 	if (addxftfont(fontset->xft_fontset, font) == -1)
 		goto done;
-	retfont = font;
-	font = (struct FntPatt){ NULL, NULL };
+	retval = 0;
+	font = (struct FntPatt){ .xftfont = NULL, .pattern = NULL };
 done:
-	if (fccharset != NULL)
-		FcCharSetDestroy(fccharset);
-	if (fcpattern != NULL)
-		FcPatternDestroy(fcpattern);
-	if (font.pattern != NULL)
-		XftPatternDestroy(font.pattern);
-	if (font.xftfont != NULL)
-		XftFontClose(fontset->display, font.xftfont);
+	closefallback(fontset, &font);
+	if (match != NULL)
+		FcPatternDestroy(match);
+	if (request != NULL)
+		FcPatternDestroy(request);
 #endif /* CTRLFNT_NO_SEARCH */
+	(void)fontset;
 	(void)glyph;
-	return retfont;
+	return retval;
 }
 
-static XftFont *
-getfontforglyph(ctrlfnt *fontset, FcChar32 glyph)
+static unsigned short *
+getglyphslot(ctrlfnt *fontset, FcChar32 glyph)
 {
-	for (size_t i = 0; i < fontset->xft_fontset->nmemb; i++)
-		if (XftCharExists(fontset->display,
-		    fontset->xft_fontset->fonts[i].xftfont,
-		    glyph))
-			return fontset->xft_fontset->fonts[i].xftfont;
-	return opennewfont(fontset, glyph).xftfont;
+	struct Glyph *entry;
+	size_t bucket;
+
+	if (glyph < NBMPGLYPHS) {
+		if (fontset->bmpfonts == NULL)
+			fontset->bmpfonts = calloc(
+				NBMPGLYPHS,
+				sizeof(*fontset->bmpfonts)
+			);
+		if (fontset->bmpfonts == NULL)
+			return NULL;
+		return &fontset->bmpfonts[glyph];
+	}
+	bucket = glyph % GLYPH_BUCKETS;
+	for (entry = fontset->astralfonts[bucket]; entry != NULL; entry = entry->next)
+		if (entry->glyph == glyph)
+			return &entry->font;
+	if ((entry = malloc(sizeof(*entry))) == NULL)
+		return NULL;
+	*entry = (struct Glyph){
+		.next = fontset->astralfonts[bucket],
+		.glyph = glyph,
+		.font = GLYPH_UNKNOWN,
+	};
+	fontset->astralfonts[bucket] = entry;
+	return &entry->font;
 }
 
-static size_t
-getfontcoverage(ctrlfnt *fontset, XftFont *font, FcChar32 *glyphs, size_t nglyphs)
+static void
+forgetmissingglyphs(ctrlfnt *fontset)
 {
-	size_t n;
+	struct Glyph *entry;
 
-	for (n = 0; n < nglyphs; n++) {
-		if (!XftCharExists(fontset->display, font, glyphs[n]))
-			return n;
-		for (size_t i = 0; i < fontset->xft_fontset->nmemb; i++) {
-			if (fontset->xft_fontset->fonts[i].xftfont == font)
+	/* a fallback font was added; it may cover glyphs we had given up on */
+	if (fontset->bmpfonts != NULL)
+		for (size_t i = 0; i < NBMPGLYPHS; i++)
+			if (fontset->bmpfonts[i] == GLYPH_MISSING)
+				fontset->bmpfonts[i] = GLYPH_UNKNOWN;
+	for (size_t i = 0; i < GLYPH_BUCKETS; i++)
+		for (entry = fontset->astralfonts[i]; entry != NULL; entry = entry->next)
+			if (entry->font == GLYPH_MISSING)
+				entry->font = GLYPH_UNKNOWN;
+}
+
+static void
+freeglyphslots(ctrlfnt *fontset)
+{
+	struct Glyph *entry, *next;
+
+	free(fontset->bmpfonts);
+	fontset->bmpfonts = NULL;
+	for (size_t i = 0; i < GLYPH_BUCKETS; i++) {
+		for (entry = fontset->astralfonts[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+		fontset->astralfonts[i] = NULL;
+	}
+}
+
+static void
+fillglyphblock(ctrlfnt *fontset, FcChar32 first)
+{
+	struct VArray *fonts = fontset->xft_fontset;
+	unsigned short *slots = fontset->bmpfonts + first;
+	size_t i;
+
+	/*
+	 * Glyphs of a label tend to come from the same script; resolving
+	 * the whole block turns the lookup of its other glyphs into a
+	 * table read.  Glyphs no font has are left for getfontforglyph().
+	 */
+	for (FcChar32 c = 0; c < GLYPH_BLOCK; c++) {
+		if (slots[c] != GLYPH_UNKNOWN)
+			continue;
+		for (i = 0; i < fonts->nmemb && i + 1 < GLYPH_MISSING; i++) {
+			if (hasglyph(fontset->display, &fonts->fonts[i], first + c)) {
+				slots[c] = i + 1;
 				break;
-			if (XftCharExists(fontset->display,
-			    fontset->xft_fontset->fonts[i].xftfont,
-			    glyphs[n])) /* glyph exist on earlier font */
-				return n;
+			}
+		}
+	}
+}
+
+static size_t
+getfontforglyph(ctrlfnt *fontset, FcChar32 glyph)
+{
+	struct VArray *fonts = fontset->xft_fontset;
+	unsigned short *slot;
+	size_t i;
+
+	slot = getglyphslot(fontset, glyph);
+	if (slot != NULL && *slot == GLYPH_UNKNOWN && glyph < NBMPGLYPHS)
+		fillglyphblock(fontset, glyph & ~(FcChar32)(GLYPH_BLOCK - 1));
+	if (slot != NULL && *slot == GLYPH_MISSING)
+		return 0;
+	if (slot != NULL && *slot != GLYPH_UNKNOWN)
+		return *slot - 1;
+	for (i = 0; i < fonts->nmemb; i++)
+		if (hasglyph(fontset->display, &fonts->fonts[i], glyph))
+			break;
+	if (i == fonts->nmemb) {
+		if (opennewfont(fontset, glyph) == 0) {
+			forgetmissingglyphs(fontset);
+		} else {
+			if (slot != NULL)
+				*slot = GLYPH_MISSING;
+			return 0;
 		}
 	}
+	if (slot != NULL && i + 1 < GLYPH_MISSING)
+		*slot = i + 1;
+	return i;
+}
+
+static size_t
+getfontcoverage(ctrlfnt *fontset, size_t font, FcChar32 *glyphs, size_t nglyphs)
+{
+	size_t n;
+
+	/* the font draws every glyph no earlier font has; one table read each */
+	for (n = 0; n < nglyphs; n++)
+		if (getfontforglyph(fontset, glyphs[n]) != font)
+			break;
 	return n;
 }
 
@@ -355,57 +825,255 @@ utf8toxchar2b(XChar2b *glyphs, int maxglyphs, const char *text, int nbytes)
 }
 
 static int
-drawxftstring(ctrlfnt *fontset, Picture picture, Picture src,
-             XRectangle rect, const char *text, int nbytes)
+widthascii(struct FntPatt *font, const char *text, int nbytes)
 {
-	FT_UInt glyphs[MAXGLYPHS];
-	XftFont *font;
+	unsigned char bits = 0;
+	int missing = 0;
+	int width = 0;
+	int i;
+
+	/*
+	 * Plain ASCII drawn by the first font is measured from its table,
+	 * without any call to Xft; -1 tells the caller to go the long way.
+	 */
+	for (i = 0; i < nbytes; i++)
+		bits |= (unsigned char)text[i];
+	if (bits >= NASCII)
+		return -1;
+	for (i = 0; i < nbytes; i++) {
+		missing |= font->advance[(unsigned char)text[i]];
+		width += font->advance[(unsigned char)text[i]];
+	}
+	return missing < 0 ? -1 : width;
+}
+
+static int
+layoutxftstring(ctrlfnt_layout *layout, const char *text, int nbytes)
+{
+	ctrlfnt *fontset = layout->fontset;
+	struct FntPatt *font0;
 	XGlyphInfo extents;
-	const char *end = text;
-	size_t nglyphs = 0;
+	XftFont *font;
+	FcChar32 *glyphs;
+	size_t nglyphs;
 	size_t nwritten = 0;
-	size_t n = 0;
-	int x = rect.x;
-	int w = 0;
+	size_t i, n;
 
-	if (nbytes == 0)
+	if (nbytes <= 0)
 		return 0;
-	while (end < text + nbytes && end < text + MAXGLYPHS)
-		glyphs[nglyphs++] = getnextutf8char(end, &end);
+	font0 = &fontset->xft_fontset->fonts[0];
+	if (widthascii(font0, text, nbytes) >= 0) {
+		layout->specs = malloc(nbytes * sizeof(*layout->specs));
+		layout->advance = malloc(nbytes * sizeof(*layout->advance));
+		if (layout->specs == NULL || layout->advance == NULL)
+			return -1;
+		for (i = 0; i < (size_t)nbytes; i++) {
+			layout->specs[i] = (XftGlyphFontSpec){
+				.font = font0->xftfont,
+				.glyph = font0->glyph[(unsigned char)text[i]],
+				.x = 0,
+				.y = font0->xftfont->ascent / 2
+				   - font0->xftfont->descent / 2,
+			};
+			layout->advance[i] = layout->width;
+			layout->width += font0->advance[(unsigned char)text[i]];
+		}
+		layout->nspecs = nbytes;
+		return 0;
+	}
+	/* no character is encoded in less than one byte */
+	if ((glyphs = malloc(nbytes * sizeof(*glyphs))) == NULL)
+		return -1;
+	nglyphs = decodeutf8(glyphs, text, nbytes);
+	layout->specs = malloc(nglyphs * sizeof(*layout->specs));
+	layout->advance = malloc(nglyphs * sizeof(*layout->advance));
+	if (layout->specs == NULL || layout->advance == NULL) {
+		free(glyphs);
+		return -1;
+	}
 	while (nwritten < nglyphs) {
-		font = getfontforglyph(fontset, glyphs[nwritten]);
+		i = getfontforglyph(fontset, glyphs[nwritten]);
+		font = fontset->xft_fontset->fonts[i].xftfont;
 		n = 1 + getfontcoverage(
 			fontset,
-			font,
+			i,
 			glyphs + nwritten + 1,
 			nglyphs - nwritten - 1
 		);
-		XftTextRender32(
-			fontset->display,
-			PictOpOver,
-			src,
-			font,
-			picture,
-			0, 0,
-			x + w,
-			rect.y + rect.height / 2
-			       + font->ascent / 2
-			       - font->descent / 2,
+		for (; n > 0; n--, nwritten++) {
+			layout->specs[layout->nspecs] = (XftGlyphFontSpec){
+				.font = font,
+				.glyph = XftCharIndex(
+					fontset->display,
+					font,
+					glyphs[nwritten]
+				),
+				.x = 0,
+				.y = font->ascent / 2 - font->descent / 2,
+			};
+			layout->advance[layout->nspecs] = layout->width;
+			XftGlyphExtents(
+				fontset->display,
+				font,
+				&layout->specs[layout->nspecs].glyph,
+				1,
+				&extents
+			);
+			layout->width += extents.xOff;
+			layout->nspecs++;
+		}
+	}
+	free(glyphs);
+	return 0;
+}
 
-			glyphs + nwritten,
-			n
-		);
-		XftTextExtents32(
+static int
+growspecs(ctrlfnt *fontset, size_t nspecs)
+{
+	XftGlyphFontSpec *specs;
+	size_t size;
+
+	if (fontset->specsize >= nspecs)
+		return 0;
+	size = nspecs > MAXGLYPHS ? nspecs : MAXGLYPHS;
+	if ((specs = realloc(fontset->specs, size * sizeof(*specs))) == NULL)
+		return -1;
+	fontset->specs = specs;
+	fontset->specsize = size;
+	return 0;
+}
+
+static void
+setellipsis(ctrlfnt *fontset)
+{
+	struct FntPatt *font;
+	XGlyphInfo extents;
+	FcChar32 glyph = 0x2026;        /* HORIZONTAL ELLIPSIS */
+	size_t i;
+
+	if (fontset->ellipsisw >= 0)
+		return;
+	i = getfontforglyph(fontset, glyph);
+	font = &fontset->xft_fontset->fonts[i];
+	fontset->nellipsis = 1;
+	if (!hasglyph(fontset->display, font, glyph)) {
+		font = &fontset->xft_fontset->fonts[0];
+		glyph = '.';
+		fontset->nellipsis = MAXELLIPSIS;
+	}
+	fontset->ellipsisw = 0;
+	for (i = 0; i < fontset->nellipsis; i++) {
+		fontset->ellipsis[i] = (XftGlyphFontSpec){
+			.font = font->xftfont,
+			.glyph = XftCharIndex(fontset->display, font->xftfont, glyph),
+			.x = fontset->ellipsisw,
+			.y = font->xftfont->ascent / 2 - font->xftfont->descent / 2,
+		};
+		XftGlyphExtents(
 			fontset->display,
-			font,
-			glyphs + nwritten,
-			n,
+			font->xftfont,
+			&fontset->ellipsis[i].glyph,
+			1,
 			&extents
 		);
-		w += extents.width;
-		nwritten += n;
+		fontset->ellipsisw += extents.xOff;
+	}
+}
+
+static size_t
+fitlayout(ctrlfnt_layout *layout, int maxw, int *width)
+{
+	ctrlfnt *fontset = layout->fontset;
+	size_t lo, hi, mid, n;
+
+	n = layout->nspecs;
+	*width = layout->width;
+	if (n == 0 || layout->width <= maxw)
+		return n;
+
+	/*
+	 * Keep the most glyphs that, ended by the ellipsis, fit in maxw,
+	 * searching the cumulative advances of the layout; the width is
+	 * that of what is drawn, zero if not even the ellipsis fits.
+	 */
+	setellipsis(fontset);
+	if (fontset->ellipsisw > maxw) {
+		*width = 0;
+		return 0;
+	}
+	lo = 0;
+	hi = n - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (layout->advance[mid] + fontset->ellipsisw <= maxw)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	*width = layout->advance[lo] + fontset->ellipsisw;
+	return lo;
+}
+
+static size_t
+placespecs(XftGlyphFontSpec *specs, ctrlfnt_layout *layout, XRectangle rect,
+           int *width)
+{
+	ctrlfnt *fontset = layout->fontset;
+	size_t i, n;
+
+	n = fitlayout(layout, rect.width, width);
+	if (*width == 0 && n < layout->nspecs)
+		return 0;       /* not even the ellipsis fits */
+	for (i = 0; i < n; i++) {
+		/* no drawable reaches past where a short can place a glyph */
+		if (rect.x + layout->advance[i] > SHRT_MAX)
+			return i;
+		specs[i] = layout->specs[i];
+		specs[i].x = rect.x + layout->advance[i];
+		specs[i].y += rect.y + rect.height / 2;
 	}
-	return w;
+	if (n == layout->nspecs ||
+	    rect.x + layout->advance[n] + fontset->ellipsisw > SHRT_MAX)
+		return n;
+	for (i = 0; i < fontset->nellipsis; i++) {
+		specs[n + i] = fontset->ellipsis[i];
+		specs[n + i].x += rect.x + layout->advance[n];
+		specs[n + i].y += rect.y + rect.height / 2;
+	}
+	return n + fontset->nellipsis;
+}
+
+static int
+drawxftlayout(ctrlfnt_layout *layout, Picture picture, Picture src,
+              XRectangle rect)
+{
+	ctrlfnt *fontset = layout->fontset;
+	size_t nspecs;
+	int width;
+
+	if (layout->nspecs == 0)
+		return 0;
+	if (growspecs(fontset, layout->nspecs + MAXELLIPSIS) == -1)
+		return -1;
+	nspecs = placespecs(fontset->specs, layout, rect, &width);
+	if (nspecs == 0)
+		return width;
+
+	/*
+	 * Xft keeps a GlyphSet for each font, uploading each glyph once;
+	 * the whole string goes out in a single CompositeText request,
+	 * with one element for each change of font.
+	 */
+	XftGlyphFontSpecRender(
+		fontset->display,
+		PictOpOver,
+		src,
+		picture,
+		0, 0,
+		fontset->specs,
+		nspecs
+	);
+	return width;
 }
 
 static int
@@ -450,114 +1118,116 @@ drawxstring(ctrlfnt *fontset, Pixmap pix, GC gc, XRectangle rect,
 	return XTextWidth16(fontset->xlfd_font, glyphs, nglyphs);
 }
 
-static int
-drawx(ctrlfnt *fontset, Picture picture, Picture src,
-      XRectangle rect, const char *text, int nbytes)
+static void
+freescratch(ctrlfnt *fontset)
 {
-	Pixmap pix = None;
-	Picture mask = None;
-	GC gc = NULL;
-	int retval;
+	if (fontset->scratchmask != None)
+		XRenderFreePicture(fontset->display, fontset->scratchmask);
+	if (fontset->scratchgc != NULL)
+		XFreeGC(fontset->display, fontset->scratchgc);
+	if (fontset->scratch != None)
+		XFreePixmap(fontset->display, fontset->scratch);
+	fontset->scratchmask = None;
+	fontset->scratchgc = NULL;
+	fontset->scratch = None;
+	fontset->scratchw = fontset->scratchh = 0;
+}
 
-	pix = XCreatePixmap(
+static int
+growscratch(ctrlfnt *fontset, int width, int height)
+{
+	if (fontset->scratch != None &&
+	    width <= fontset->scratchw &&
+	    height <= fontset->scratchh)
+		return 0;
+	if (width < fontset->scratchw)
+		width = fontset->scratchw;
+	if (height < fontset->scratchh)
+		height = fontset->scratchh;
+	freescratch(fontset);
+	fontset->scratch = XCreatePixmap(
 		fontset->display,
 		RootWindow(fontset->display, fontset->screen),
-		rect.width,
-		rect.height,
+		width,
+		height,
 		1
 	);
-	if (pix == None)
+	if (fontset->scratch == None)
 		goto error;
-	gc = XCreateGC(fontset->display, pix, 0, NULL);
-	if (gc == NULL)
+	fontset->scratchgc = XCreateGC(fontset->display, fontset->scratch, 0, NULL);
+	if (fontset->scratchgc == NULL)
 		goto error;
-	mask = XRenderCreatePicture(
+	fontset->scratchmask = XRenderCreatePicture(
 		fontset->display,
-		pix,
+		fontset->scratch,
 		XRenderFindStandardFormat(
 			fontset->display,
 			PictStandardA1
 		),
 		0, NULL
 	);
-	if (mask == None)
+	if (fontset->scratchmask == None)
 		goto error;
-	XSetForeground(fontset->display, gc, 0);
+	fontset->scratchw = width;
+	fontset->scratchh = height;
+	return 0;
+error:
+	freescratch(fontset);
+	return -1;
+}
+
+static int
+drawx(ctrlfnt *fontset, Picture picture, Picture src,
+      XRectangle rect, const char *text, int nbytes)
+{
+	int retval;
+
+	if (growscratch(fontset, rect.width, rect.height) == -1)
+		return -1;
+
+	/* only the rectangle is cleared and composited; the rest is junk */
+	XSetForeground(fontset->display, fontset->scratchgc, 0);
 	XFillRectangle(
 		fontset->display,
-		pix,
-		gc,
+		fontset->scratch,
+		fontset->scratchgc,
 		0, 0,
 		rect.width,
 		rect.height
 	);
-	XSetForeground(fontset->display, gc, 1);
+	XSetForeground(fontset->display, fontset->scratchgc, 1);
 	if (fontset->xlfd_font != NULL)
-		retval = drawxstring(fontset, pix, gc, rect, text, nbytes);
+		retval = drawxstring(
+			fontset,
+			fontset->scratch,
+			fontset->scratchgc,
+			rect,
+			text,
+			nbytes
+		);
 	else if (fontset->xlfd_fontset != NULL)
-		retval = drawxmbstring(fontset, pix, gc, rect, text, nbytes);
+		retval = drawxmbstring(
+			fontset,
+			fontset->scratch,
+			fontset->scratchgc,
+			rect,
+			text,
+			nbytes
+		);
 	else
-		goto error;
+		return -1;
 	XRenderComposite(
 		fontset->display,
 		PictOpOver,
 		src,
-		mask,
+		fontset->scratchmask,
 		picture,
 		0, 0,
 		0, 0,
 		rect.x, rect.y,
 		rect.width, rect.height
 	);
-	XFreeGC(fontset->display, gc);
-	XFreePixmap(fontset->display, pix);
-	XRenderFreePicture(fontset->display, mask);
 	return retval;
-error:
-	if (gc != NULL)
-		XFreeGC(fontset->display, gc);
-	if (pix != None)
-		XFreePixmap(fontset->display, pix);
-	if (mask != None)
-		XRenderFreePicture(fontset->display, mask);
-	return -1;
-}
-
-static int
-widthxftstring(ctrlfnt *fontset, const char *text, int nbytes)
-{
-	FT_UInt glyphs[MAXGLYPHS];
-	XftFont *font;
-	XGlyphInfo extents;
-	const char *end = text;
-	size_t nglyphs = 0;
-	size_t nwritten = 0;
-	size_t n = 0;
-	int width = 0;
-
-	if (nbytes == 0)
-		return 0;
-	while (end < text + nbytes)
-		glyphs[nglyphs++] = getnextutf8char(end, &end);
-	while (nwritten < nglyphs) {
-		font = getfontforglyph(fontset, glyphs[nwritten]);
-		n = 1 + getfontcoverage(
-			fontset,
-			font,
-			glyphs + nwritten + 1,
-			nglyphs - nwritten - 1
-		);
-		XftTextExtents32(
-			fontset->display,
-			font,
-			glyphs + nwritten,
-			n,
-			&extents
-		);
-		nwritten += n;
-		width += extents.xOff;
-	}
-	return width;
 }
 
 static int
@@ -579,6 +1249,112 @@ widthxstring(ctrlfnt *fontset, const char *text, int nbytes)
 	return XTextWidth16(fontset->xlfd_font, glyphs, nglyphs);
 }
 
+ctrlfnt_layout *
+ctrlfnt_layout_open(ctrlfnt *fontset, const char *text, int nbytes)
+{
+	ctrlfnt_layout *layout;
+
+	if (fontset == NULL)
+		return NULL;
+	if ((layout = malloc(sizeof(*layout))) == NULL)
+		goto error;
+	*layout = (ctrlfnt_layout){
+		.fontset = fontset,
+		.width = 0,
+		.specs = NULL,
+		.advance = NULL,
+		.nspecs = 0,
+		.text = NULL,
+		.nbytes = 0,
+	};
+	if (fontset->xft_fontset != NULL) {
+		if (layoutxftstring(layout, text, nbytes) == -1)
+			goto error;
+		return layout;
+	}
+	if (nbytes > 0) {
+		if ((layout->text = malloc(nbytes)) == NULL)
+			goto error;
+		memcpy(layout->text, text, nbytes);
+	}
+	layout->nbytes = nbytes;
+	if (fontset->xlfd_fontset != NULL)
+		layout->width = widthxmbstring(fontset, text, nbytes);
+	else if (fontset->xlfd_font != NULL)
+		layout->width = widthxstring(fontset, text, nbytes);
+	return layout;
+error:
+	warnx("could not lay out text");
+	ctrlfnt_layout_free(layout);
+	return NULL;
+}
+
+int
+ctrlfnt_layout_width(ctrlfnt_layout *layout)
+{
+	if (layout == NULL)
+		return -1;
+	return layout->width;
+}
+
+int
+ctrlfnt_layout_fit(ctrlfnt_layout *layout, int width)
+{
+	int drawn;
+
+	if (layout == NULL)
+		return -1;
+	if (layout->fontset->xft_fontset == NULL)
+		return layout->width < width ? layout->width : width;
+	(void)fitlayout(layout, width, &drawn);
+	return drawn;
+}
+
+int
+ctrlfnt_layout_draw(ctrlfnt_layout *layout, Picture picture, Picture src,
+                    XRectangle rect)
+{
+	if (layout == NULL)
+		return -1;
+	if (rect.width < 1)
+		rect.width = 1;
+	if (rect.height < 1)
+		rect.height = 1;
+	if (layout->fontset->xft_fontset != NULL)
+		return drawxftlayout(layout, picture, src, rect);
+	return drawx(
+		layout->fontset,
+		picture,
+		src,
+		rect,
+		layout->text,
+		layout->nbytes
+	);
+}
+
+void
+ctrlfnt_layout_free(ctrlfnt_layout *layout)
+{
+	if (layout == NULL)
+		return;
+	free(layout->specs);
+	free(layout->advance);
+	free(layout->text);
+	free(layout);
+}
+
+static unsigned long
+hashtext(const char *text, int nbytes)
+{
+	unsigned long h = 2166136261UL;
+
+	for (int i = 0; i < nbytes; i++) {
+		h ^= (unsigned char)text[i];
+		h *= 16777619UL;
+	}
+	return h;
+}
+
 ctrlfnt *
 ctrlfnt_open(Display *display, int screen, Visual *visual, Colormap
              colormap, const char *fontspec, double fontsize)
@@ -605,7 +1381,24 @@ ctrlfnt_open(Display *display, int screen, Visual *visual, Colormap
 		.xft_fontset = NULL,
 		.xlfd_fontset = NULL,
 		.xlfd_font = NULL,
+		.bmpfonts = NULL,
+		.specs = NULL,
+		.specsize = 0,
+		.nellipsis = 0,
+		.ellipsisw = -1,
+		.key = hashtext(fontspec, strlen(fontspec)),
+		.cachedir = NULL,
+		.cachepath = NULL,
+		.fallbacks = NULL,
+		.cachedirty = 0,
+		.scratch = None,
+		.scratchmask = None,
+		.scratchgc = NULL,
+		.scratchw = 0,
+		.scratchh = 0,
 	};
+	fontset->key ^= (unsigned long)(fontsize * 64.0);
+	fontset->key *= 16777619UL;
 	if (strncasecmp(fontspec, "x:", 2) == 0) {
 		str = fontspec + 2;
 		fonttype = hascomma ? XLFD_FONTSET : XLFD_FONT;
@@ -649,14 +1442,22 @@ int
 ctrlfnt_draw(ctrlfnt *fontset, Picture picture, Picture src,
              XRectangle rect, const char *text, int nbytes)
 {
+	ctrlfnt_layout *layout;
+	int width;
+
 	if (rect.width < 1)
 		rect.width = 1;
 	if (rect.height < 1)
 		rect.height = 1;
 	if (fontset == NULL)
 		return -1;
-	if (fontset->xft_fontset != NULL)
-		return drawxftstring(fontset, picture, src, rect, text, nbytes);
+	if (fontset->xft_fontset != NULL) {
+		if ((layout = ctrlfnt_layout_open(fontset, text, nbytes)) == NULL)
+			return -1;
+		width = drawxftlayout(layout, picture, src, rect);
+		ctrlfnt_layout_free(layout);
+		return width;
+	}
 	if (fontset->xlfd_fontset != NULL)
 		return drawx(fontset, picture, src, rect, text, nbytes);
 	if (fontset->xlfd_font != NULL)
@@ -664,13 +1465,176 @@ ctrlfnt_draw(ctrlfnt *fontset, Picture picture, Picture src,
 	return -1;
 }
 
+static int
+cmpsrc(const void *a, const void *b)
+{
+	const struct DrawOrder *p = a, *q = b;
+
+	if (p->src != q->src)
+		return p->src < q->src ? -1 : 1;
+	return p->index < q->index ? -1 : p->index > q->index;
+}
+
+static int
+cmpfirst(const void *a, const void *b)
+{
+	const struct DrawOrder *p = a, *q = b;
+
+	if (p->first != q->first)
+		return p->first < q->first ? -1 : 1;
+	return p->index < q->index ? -1 : p->index > q->index;
+}
+
+int
+ctrlfnt_draw_many(ctrlfnt *fontset, Picture picture,
+                  struct ctrlfnt_text *texts, size_t ntexts)
+{
+	ctrlfnt_layout **layouts = NULL;
+	struct DrawOrder *order = NULL;
+	size_t i, j, nspecs;
+	int width;
+	int retval = -1;
+
+	if (fontset == NULL)
+		return -1;
+	if (fontset->xft_fontset == NULL) {
+		/* core fonts are drawn through a mask, one string at a time */
+		retval = 0;
+		for (i = 0; i < ntexts; i++) {
+			if (texts[i].layout != NULL && ctrlfnt_layout_draw(
+				texts[i].layout,
+				picture,
+				texts[i].src,
+				texts[i].rect
+			) < 0)
+				retval = -1;
+			if (texts[i].layout == NULL && ctrlfnt_draw(
+				fontset,
+				picture,
+				texts[i].src,
+				texts[i].rect,
+				texts[i].text,
+				texts[i].nbytes
+			) < 0)
+				retval = -1;
+		}
+		return retval;
+	}
+	if (ntexts == 0)
+		return 0;
+	if ((layouts = calloc(ntexts, sizeof(*layouts))) == NULL)
+		goto done;
+	nspecs = 0;
+	for (i = 0; i < ntexts; i++) {
+		layouts[i] = texts[i].layout;
+		if (layouts[i] == NULL)
+			layouts[i] = ctrlfnt_layout_open(
+				fontset,
+				texts[i].text,
+				texts[i].nbytes
+			);
+		if (layouts[i] == NULL)
+			goto done;
+		nspecs += layouts[i]->nspecs + MAXELLIPSIS;
+	}
+	if (growspecs(fontset, nspecs) == -1)
+		goto done;
+
+	/*
+	 * Strings of a color are all drawn in one request, in the order
+	 * they were given; colors are drawn in the order they first
+	 * appear, so what is drawn over what stays the same.  Sorting by
+	 * color and then by first appearance groups them in n log n.
+	 */
+	if ((order = calloc(ntexts, sizeof(*order))) == NULL)
+		goto done;
+	for (i = 0; i < ntexts; i++)
+		order[i] = (struct DrawOrder){ .src = texts[i].src, .index = i };
+	qsort(order, ntexts, sizeof(*order), cmpsrc);
+	for (i = 0; i < ntexts; i++) {
+		if (i > 0 && order[i].src == order[i - 1].src)
+			order[i].first = order[i - 1].first;
+		else
+			order[i].first = order[i].index;
+	}
+	qsort(order, ntexts, sizeof(*order), cmpfirst);
+	for (i = 0; i < ntexts; i = j) {
+		nspecs = 0;
+		for (j = i; j < ntexts && order[j].first == order[i].first; j++) {
+			nspecs += placespecs(
+				fontset->specs + nspecs,
+				layouts[order[j].index],
+				texts[order[j].index].rect,
+				&width
+			);
+		}
+		if (nspecs == 0)
+			continue;
+		XftGlyphFontSpecRender(
+			fontset->display,
+			PictOpOver,
+			order[i].src,
+			picture,
+			0, 0,
+			fontset->specs,
+			nspecs
+		);
+	}
+	retval = 0;
+done:
+	for (i = 0; layouts != NULL && i < ntexts; i++)
+		if (texts[i].layout == NULL)
+			ctrlfnt_layout_free(layouts[i]);
+	free(layouts);
+	free(order);
+	return retval;
+}
+
+int
+ctrlfnt_cache(ctrlfnt *fontset, const char *dir)
+{
+	char path[PATH_MAX];
+	int n;
+
+	if (fontset == NULL || fontset->xft_fontset == NULL)
+		return 0;
+	n = snprintf(path, sizeof(path), "%s/fonts-%lx", dir, fontset->key);
+	if (n < 0 || (size_t)n >= sizeof(path))
+		return -1;
+	savefallbacks(fontset);
+	freefallbacks(fontset);
+	free(fontset->cachedir);
+	free(fontset->cachepath);
+	fontset->cachedir = strdup(dir);
+	fontset->cachepath = strdup(path);
+	if (fontset->cachedir == NULL || fontset->cachepath == NULL) {
+		free(fontset->cachedir);
+		free(fontset->cachepath);
+		fontset->cachedir = fontset->cachepath = NULL;
+		return -1;
+	}
+	loadfallbacks(fontset);
+	return 0;
+}
+
 int
 ctrlfnt_width(ctrlfnt *fontset, const char *text, int nbytes)
 {
+	ctrlfnt_layout *layout;
+	int width;
+
 	if (fontset == NULL)
 		return 0;
-	if (fontset->xft_fontset != NULL)
-		return widthxftstring(fontset, text, nbytes);
+	if (fontset->xft_fontset != NULL) {
+		width = widthascii(&fontset->xft_fontset->fonts[0], text, nbytes);
+		if (width >= 0)
+			return width;
+		if ((layout = ctrlfnt_layout_open(fontset, text, nbytes)) == NULL)
+			return -1;
+		width = layout->width;
+		ctrlfnt_layout_free(layout);
+		return width;
+	}
 	if (fontset->xlfd_fontset != NULL)
 		return widthxmbstring(fontset, text, nbytes);
 	if (fontset->xlfd_font != NULL)
@@ -746,6 +1710,13 @@ ctrlfnt_free(ctrlfnt *fontset)
 {
 	if (fontset == NULL)
 		return;
+	freeglyphslots(fontset);
+	free(fontset->specs);
+	savefallbacks(fontset);
+	freefallbacks(fontset);
+	free(fontset->cachedir);
+	free(fontset->cachepath);
+	freescratch(fontset);
 	if (fontset->xft_fontset != NULL) {
 		for (size_t i = 0; i < fontset->xft_fontset->nmemb; i++) {
 			XftFontClose(
@@ -1,4 +1,13 @@
 typedef struct ctrlfnt ctrlfnt;
+typedef struct ctrlfnt_layout ctrlfnt_layout;
+
+struct ctrlfnt_text {
+	const char     *text;
+	int             nbytes;
+	ctrlfnt_layout *layout;         /* if not NULL, used instead of text */
+	XRectangle      rect;
+	Picture         src;
+};
 
 ctrlfnt *
 ctrlfnt_open(
@@ -20,6 +29,33 @@ ctrlfnt_draw(
 	int             nbytes
 );
 
+int
+ctrlfnt_draw_many(
+	ctrlfnt        *fontset,
+	Picture         picture,
+	struct ctrlfnt_text *texts,
+	size_t          ntexts
+);
+
+ctrlfnt_layout *
+ctrlfnt_layout_open(
+	ctrlfnt        *fontset,
+	const char     *text,
+	int             nbytes
+);
+
+int
+ctrlfnt_layout_draw(
+	ctrlfnt_layout *layout,
+	Picture         picture,
+	Picture         src,
+	XRectangle      rect
+);
+
+int ctrlfnt_layout_width(ctrlfnt_layout *layout);
+int ctrlfnt_layout_fit(ctrlfnt_layout *layout, int width);
+void ctrlfnt_layout_free(ctrlfnt_layout *layout);
+int ctrlfnt_cache(ctrlfnt *fontset, const char *dir);
 int ctrlfnt_width(ctrlfnt *fontset, const char *text, int nbytes);
 int ctrlfnt_height(ctrlfnt *fontset);
 int ctrlfnt_ascent(ctrlfnt *fontset);
@@ -1,3 +1,5 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <ctype.h>
@@ -8,9 +10,11 @@
 #include <limits.h>
 #include <locale.h>
 #include <poll.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +37,7 @@
 #define LEN(a)                  (sizeof(a) / sizeof((a)[0]))
 #define MAX(a, b)               ((a)>(b)?(a):(b))
 #define MIN(a, b)               ((a)<(b)?(a):(b))
+#define ROUNDUP(n, m)           (((n) + (m) - 1) / (m) * (m))
 #define FLAG(f, b)              (((f) & (b)) == (b))
 #define RETURN_FAILURE          (-1)
 #define RETURN_SUCCESS          0
@@ -43,6 +48,27 @@
 #define TRIANGLE_HEIGHT         8
 #define TRIANGLE_WIDTH          3
 #define TRIANGLE_PAD            8
+#define ARROW_CELL              MAX(TRIANGLE_HEIGHT, TRIANGLE_WIDTH * 2)
+#define DASH_SIZE               8
+#define SCROLL_TIME             32      /* milliseconds a row takes to scroll */
+#define SCROLL_ACCEL            8       /* rows before scrolling goes faster */
+#define SCROLL_MAXROWS          4
+#define FRAME_TIME              16      /* milliseconds between repaints */
+#define HOVER_TIME              80      /* ms an item is hovered to open it */
+#define AIM_TIME                300     /* ms given to reach an open submenu */
+#define POOL_SIZE               8       /* closed popups kept for reuse */
+#define MENU_EVENTS             (KeyPressMask | StructureNotifyMask |     \
+                                 LeaveWindowMask | ButtonPressMask |      \
+                                 ButtonReleaseMask | PointerMotionMask)
+#define CANVAS_BUCKET           64      /* canvases grow by this many pixels */
+#define ICON_BUCKETS            256
+#define ICON_CACHE_SIZE         (2048 * 1024)
+#define ICONINDEX_TIME          2       /* seconds between checks of ICONPATH */
+#define ATLAS_COLUMNS           16
+#define ATLAS_CELLS             64
+#define THUMB_MAGIC             "XMENUTHB"
+#define THUMB_BYTEORDER         0x01020304
+#define THUMB_ALIGN(n)          (((n) + 3) & ~(size_t)3)
 
 #define ATOMS                                   \
 	X(UTF8_STRING)                          \
@@ -67,6 +93,7 @@
 	X(FACE_NAME,    "FaceName",             "faceName"              ) \
 	X(FACE_SIZE,    "FaceSize",             "faceSize"              ) \
 	X(GAP_WID,      "Gap",                  "gap"                   ) \
+	X(ICON_CACHE,   "IconCacheSize",        "iconCacheSize"         ) \
 	X(ICON_SIZE,    "IconSize",             "iconSize"              ) \
 	X(MAX_ITEMS,    "MaxItems",             "maxItems"              ) \
 	X(NORMAL_BG,    "Background",           "background"            ) \
@@ -112,12 +139,6 @@ enum {
 	CANVAS_LAST
 };
 
-enum {
-	LAYER_BG,
-	LAYER_FG,
-	LAYER_LAST
-};
-
 enum {
 	DIR_UP,
 	DIR_DOWN,
@@ -145,12 +166,52 @@ typedef struct Item {
 	char *altoutput;        /* string to be outputed when item is clicked with alt button */
 	char *file;             /* filename of the icon */
 	size_t labellen;
+	ctrlfnt_layout *layout; /* label laid out in the current font */
+	int textw;              /* width of the label */
+	unsigned int textgen;   /* font generation of layout and textw */
 	struct Item *prev;
 	struct Item *next;
 	struct Item *parent;
 	struct Item *children;
 } Item;
 
+typedef struct Icon {
+	struct Icon *qnext;     /* next icon in the loader queue */
+	struct Icon *hnext;     /* next icon in the same hash bucket */
+	struct Icon *prev;      /* more recently used icon */
+	struct Icon *next;      /* less recently used icon */
+	char *file;             /* filename, as given in the menu */
+	int size;               /* size the icon was scaled to */
+	int width, height;
+	int cell;               /* cell in the icon atlas; -1 if not uploaded */
+	uint32_t *pixels;       /* premultiplied ARGB; NULL if loading failed */
+	void *map;              /* thumbnail mapping holding pixels, if any */
+	size_t mapsize;
+	size_t nbytes;          /* memory accounted to this icon */
+	bool pending;           /* whether the loader thread still owns it */
+} Icon;
+
+/* file in one of the ICONPATH directories */
+struct IconEntry {
+	struct IconEntry *next;
+	size_t dir;             /* first ICONPATH directory containing it */
+	char name[];
+};
+
+/* header of the pre-scaled icons kept in the on-disk cache */
+struct Thumbnail {
+	char magic[8];
+	uint32_t byteorder;     /* THUMB_BYTEORDER, as written by the host */
+	uint32_t size;          /* icon size the image was scaled to */
+	uint32_t width, height;
+	int64_t mtime;          /* modification time of the source image */
+	int64_t mtimensec;
+	int64_t filesize;       /* size of the source image */
+	uint32_t pathlen;       /* length of the path following the header */
+	uint32_t pad;
+	/* path, padded to 4 bytes, then width*height premultiplied ARGB */
+};
+
 typedef struct Menu {
 	struct Menu *next;
 	struct Item *items, *selected;
@@ -163,11 +224,20 @@ typedef struct Menu {
 		Pixmap pixmap;
 		Picture picture;
 	} canvas[CANVAS_LAST];
+	int canvasw, canvash;   /* size the canvases were drawn for */
+	int pixmapw, pixmaph;   /* size the canvases were allocated with */
+	int drawnposition;      /* highlighted row on the final canvas */
+	int drawnheight;
+	int paintposition;      /* row to highlight when next painted */
 	size_t nicons;
+	bool redraw;            /* whether canvases must be rebuilt */
+	bool recommit;          /* whether final canvas must be rebuilt */
+	bool dirty;             /* whether it must be painted next frame */
 	bool overflow;
 	bool hasicon;
 	bool hassubmenu;
 	bool directory;
+	bool recyclable;        /* whether its window can be pooled */
 } Menu;
 
 struct Options {
@@ -192,9 +262,17 @@ struct Options {
 	Window client;
 
 	char *iconstring;
+	char *cachedir;
 	char *iconpaths[MAXPATHS];
 	size_t niconpaths;
 
+	/* index of ICONPATH, built by the loader thread on first use */
+	struct IconEntry **iconindex;
+	size_t niconbuckets;
+	bool iconunindexed[MAXPATHS];   /* directories we could not list */
+	time_t iconmtimes[MAXPATHS];    /* modification times when indexed */
+	time_t iconchecked;             /* when they were last compared */
+
 	XRectangle geometry;
 } options = {
 	.name = "xmenu",
@@ -211,11 +289,12 @@ typedef struct Widget {
 	int fd;
 	Window rootwin;
 	Window window;
-	struct timespec lasttime;
 	XRectangle monitor;
 	XRenderPictFormat *xformat;
 	XRenderPictFormat *alphaformat;
+	XRenderPictFormat *argbformat;
 	ctrlfnt *fontset;
+	unsigned int fontgen;   /* incremented each time the font changes */
 	Cursor cursor;
 	Menu *menus;
 	unsigned int fonth;
@@ -224,6 +303,80 @@ typedef struct Widget {
 	int maxitems;
 	bool initimlib;
 	bool tearoff;
+
+	struct IconCache {
+		Icon *buckets[ICON_BUCKETS];
+		Icon *head, *tail;      /* most and least recently used */
+		size_t nbytes;
+		size_t maxbytes;
+	} icons;
+
+	/* server-side copy of the icons, uploaded once and composited from */
+	struct Atlas {
+		Pixmap pixmap;
+		Picture picture;
+		GC gc;
+		int cellsize;           /* icon size the cells were laid for */
+		int ncells;             /* number of cells in the pixmap */
+		int nused;              /* cells ever handed out */
+		int nfree;              /* cells given back by evicted icons */
+		int *freecells;
+	} atlas;
+
+	/* icons are decoded by a thread, which wakes us up through a pipe */
+	struct Loader {
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		Icon *queue, *queuetail;        /* icons to be loaded */
+		Icon *done;                     /* icons to be shown */
+		int pipefd[2];
+		bool started;
+		bool stop;
+	} loader;
+
+	GC gc;                          /* for copying within canvases */
+
+	/* menus are painted at most once per frame, after events are read */
+	struct timespec nextframe;      /* earliest time of the next paint */
+	bool dirty;                     /* whether some menu must be painted */
+
+	/* submenus opened by dragging wait for the pointer to settle */
+	struct Hover {
+		Menu *menu;             /* NULL if nothing is pending */
+		Item *item;             /* item to act on once settled */
+		Item *restore;          /* item selected before the drag */
+		struct timespec settle; /* time the pointer is deemed settled */
+		int ypos, restorepos;
+		int x, y;               /* last pointer position on the root */
+	} hover;
+
+	/* scrolling of the topmost menu while its arrow is hovered */
+	struct Scroll {
+		Menu *menu;             /* NULL if not scrolling */
+		struct timespec next;   /* time of the next step */
+		int nrows;              /* rows scrolled, for acceleration */
+		int height;             /* of the row scrolling by, 0 if none */
+		int offset;             /* pixels that row has scrolled by */
+		bool down;
+	} scrolling;
+
+	/* decorations rendered once per theme and composited from */
+	struct Chrome {
+		Pixmap dashpix, seppix, arrowpix;
+		Picture dash;           /* dash line tile, repeated */
+		Picture separator;      /* separator tile, repeated */
+		Picture arrows;         /* masks of the four arrows in a row */
+		bool stale;             /* shadow colors changed since built */
+	} chrome;
+
+	/* labels of the rows being drawn, sent in one batch per canvas */
+	struct Labels {
+		struct ctrlfnt_text *texts[CANVAS_FINAL];
+		size_t ntexts;
+		size_t size;
+	} labels;
+
 	enum {
 		ALIGN_LEFT,
 		ALIGN_CENTER,
@@ -241,6 +394,16 @@ typedef struct Widget {
 		XrmClass class;
 		XrmName name;
 	} application, resources[NRESOURCES];
+
+	/* unmapped windows and canvases of closed popups, for reuse */
+	struct Pool {
+		struct Pooled {
+			Window window;
+			struct Canvas canvas[CANVAS_LAST];
+			int pixmapw, pixmaph;
+		} entries[POOL_SIZE];
+		size_t nentries;
+	} pool;
 } Widget;
 
 static jmp_buf jmpenv;
@@ -279,6 +442,16 @@ estrdup(const char *s)
 	return t;
 }
 
+static unsigned long
+hashstr(const char *s)
+{
+	unsigned long h = 5381;
+
+	while (*s != '\0')
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
 static void
 egettime(struct timespec *ts)
 {
@@ -287,6 +460,41 @@ egettime(struct timespec *ts)
 	}
 }
 
+static void
+setdeadline(struct timespec *ts, int ms)
+{
+	egettime(ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static long
+mstodeadline(struct timespec *ts)
+{
+	struct timespec now;
+	long ms;
+
+	egettime(&now);
+	ms = (ts->tv_sec - now.tv_sec) * 1000;
+	ms += (ts->tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+static int
+mintimeout(int a, int b)
+{
+	/* poll(2) timeouts, where a negative one never expires */
+	if (a < 0)
+		return b;
+	if (b < 0)
+		return a;
+	return MIN(a, b);
+}
+
 static pid_t
 efork(void)
 {
@@ -311,6 +519,20 @@ setatoi(int *n, const char *s)
 	}
 }
 
+static void
+setkbytes(size_t *n, const char *s)
+{
+	char *endp;
+	unsigned long l;
+
+	if (s == NULL)
+		return;
+	l = strtoul(s, &endp, 10);
+	if (s[0] != '\0' && *endp == '\0' && l < SIZE_MAX / 1024) {
+		*n = l * 1024;
+	}
+}
+
 static void
 setatof(double *x, const char *s)
 {
@@ -405,6 +627,141 @@ parseiconpaths(char *s)
 	}
 }
 
+static void
+cleaniconindex(void)
+{
+	struct IconEntry *entry, *next;
+	size_t i;
+
+	if (options.iconindex == NULL)
+		return;
+	for (i = 0; i < options.niconbuckets; i++) {
+		for (entry = options.iconindex[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+	}
+	free(options.iconindex);
+	options.iconindex = NULL;
+}
+
+static time_t
+dirmtime(const char *dir)
+{
+	struct stat sb;
+
+	if (stat(dir, &sb) == RETURN_FAILURE)
+		return 0;
+	return sb.st_mtime;
+}
+
+static void
+indexiconpaths(void)
+{
+	struct IconEntry *list = NULL;
+	struct IconEntry *entry, *next, *p;
+	struct dirent *dp;
+	DIR *dirp;
+	size_t i, len, bucket;
+	size_t nentries = 0;
+
+	for (i = 0; i < options.niconpaths; i++) {
+		options.iconunindexed[i] = false;
+		options.iconmtimes[i] = dirmtime(options.iconpaths[i]);
+		if ((dirp = opendir(options.iconpaths[i])) == NULL) {
+			if (errno != ENOENT && errno != ENOTDIR)
+				options.iconunindexed[i] = true;
+			continue;
+		}
+		while ((dp = readdir(dirp)) != NULL) {
+			if (strcmp(dp->d_name, ".") == 0 ||
+			    strcmp(dp->d_name, "..") == 0)
+				continue;
+			len = strlen(dp->d_name);
+			entry = emalloc(sizeof(*entry) + len + 1);
+			entry->dir = i;
+			memcpy(entry->name, dp->d_name, len + 1);
+			entry->next = list;
+			list = entry;
+			nentries++;
+		}
+		closedir(dirp);
+	}
+	for (options.niconbuckets = 64;
+	     options.niconbuckets < nentries;
+	     options.niconbuckets *= 2)
+		;
+	options.iconindex = emalloc(options.niconbuckets * sizeof(*options.iconindex));
+	for (i = 0; i < options.niconbuckets; i++)
+		options.iconindex[i] = NULL;
+	for (entry = list; entry != NULL; entry = next) {
+		next = entry->next;
+		bucket = hashstr(entry->name) & (options.niconbuckets - 1);
+		for (p = options.iconindex[bucket]; p != NULL; p = p->next)
+			if (strcmp(p->name, entry->name) == 0)
+				break;
+		if (p != NULL) {
+			/* the earliest directory in ICONPATH wins */
+			p->dir = MIN(p->dir, entry->dir);
+			free(entry);
+			continue;
+		}
+		entry->next = options.iconindex[bucket];
+		options.iconindex[bucket] = entry;
+	}
+}
+
+static size_t
+lookupicondir(const char *file)
+{
+	struct IconEntry *entry;
+	struct timespec now;
+	size_t i, bucket;
+
+	/*
+	 * A long-running instance sees icons installed after the index
+	 * was built: every ICONINDEX_TIME seconds, the directories are
+	 * checked for changes and reindexed if any of them changed.
+	 */
+	egettime(&now);
+	if (options.iconindex != NULL &&
+	    now.tv_sec - options.iconchecked >= ICONINDEX_TIME) {
+		options.iconchecked = now.tv_sec;
+		for (i = 0; i < options.niconpaths; i++) {
+			if (dirmtime(options.iconpaths[i]) != options.iconmtimes[i]) {
+				cleaniconindex();
+				break;
+			}
+		}
+	}
+	if (options.iconindex == NULL) {
+		options.iconchecked = now.tv_sec;
+		indexiconpaths();
+	}
+	bucket = hashstr(file) & (options.niconbuckets - 1);
+	for (entry = options.iconindex[bucket]; entry != NULL; entry = entry->next)
+		if (strcmp(entry->name, file) == 0)
+			return entry->dir;
+	return options.niconpaths;
+}
+
+static void
+parsecachedir(const char *xdgcache, const char *home)
+{
+	char buf[PATH_MAX];
+	int n;
+
+	if (xdgcache != NULL && xdgcache[0] == '/')
+		n = snprintf(buf, sizeof(buf), "%s/xmenu", xdgcache);
+	else if (home != NULL && home[0] == '/')
+		n = snprintf(buf, sizeof(buf), "%s/.cache/xmenu", home);
+	else
+		return;
+	if (n > 0 && (size_t)n < sizeof(buf)) {
+		options.cachedir = estrdup(buf);
+	}
+}
+
 static bool
 setbutton(const char *s)
 {
@@ -605,7 +962,12 @@ setfont(Widget *widget, const char *facename, double facesize)
 	);
 	if (fontset == NULL)
 		return;
+	if (options.cachedir != NULL)
+		(void)ctrlfnt_cache(fontset, options.cachedir);
+	if (widget->fontset != NULL)
+		ctrlfnt_free(widget->fontset);
 	widget->fontset = fontset;
+	widget->fontgen++;
 	widget->fonth = ctrlfnt_height(fontset);
 	widget->itemh = widget->fonth + PADDING * 2;
 	widget->itemh = MAX(widget->itemh, MIN_HEIGHT);
@@ -798,6 +1160,9 @@ loadresources(Widget *widget, const char *str)
 		case GAP_WID:
 			setatoi(&widget->gap, value);
 			break;
+		case ICON_CACHE:
+			setkbytes(&widget->icons.maxbytes, value);
+			break;
 		case MAX_ITEMS:
 			setatoi(&widget->maxitems, value);
 			break;
@@ -818,6 +1183,18 @@ loadresources(Widget *widget, const char *str)
 		case NRESOURCES:
 			break;
 		}
+
+		/* the chrome tiles are filled from the shadow colors */
+		switch (resource) {
+		case _SEPARAT:
+		case SEPARAT_CLR:
+		case SHADOW_TOP:
+		case SHADOW_BOT:
+			widget->chrome.stale = true;
+			break;
+		default:
+			break;
+		}
 	}
 	if (changefont)
 		setfont(widget, fontname, fontsize);
@@ -951,6 +1328,12 @@ initvisual(Widget *widget)
 	);
 	if (widget->alphaformat == NULL)
 		goto error;
+	widget->argbformat = XRenderFindStandardFormat(
+		widget->display,
+		PictStandardARGB32
+	);
+	if (widget->argbformat == NULL)
+		goto error;
 	widget->window = createwindow(widget, NULL, 0, True);
 	if (widget->window == None) {
 		warnx("could not create window");
@@ -1006,8 +1389,10 @@ inittheme(Widget *widget)
 	widget->border.chans = COLOR(0x0000, 0x0000, 0x0000);
 	widget->borderwid = 1;
 	widget->iconsize = 16;
+	widget->icons.maxbytes = ICON_CACHE_SIZE;
 	widget->gap = 0;
 	widget->alignment = ALIGN_LEFT;
+	widget->chrome.stale = true;
 
 	for (i = 0; i < SCHEME_LAST; i++) {
 		for (j = 0; j < COLOR_LAST; j++) {
@@ -1137,12 +1522,93 @@ cleanitems(Item *item, Item *skip)
 		item = item->next;
 		if (tmp->label != tmp->output)
 			free(tmp->label);
+		ctrlfnt_layout_free(tmp->layout);
 		free(tmp->altoutput);
 		free(tmp->output);
 		free(tmp);
 	}
 }
 
+static void
+freeicon(Widget *widget, Icon *icon)
+{
+	if (icon->cell >= 0)
+		widget->atlas.freecells[widget->atlas.nfree++] = icon->cell;
+	if (icon->map != NULL)
+		munmap(icon->map, icon->mapsize);
+	else
+		free(icon->pixels);
+	free(icon->file);
+	free(icon);
+}
+
+static void
+cleanicons(Widget *widget)
+{
+	Icon *icon, *next;
+
+	for (icon = widget->icons.head; icon != NULL; icon = next) {
+		next = icon->next;
+		freeicon(widget, icon);
+	}
+	widget->icons = (struct IconCache){ 0 };
+	free(widget->atlas.freecells);
+	widget->atlas.freecells = NULL;
+}
+
+static void
+stoploader(Widget *widget, bool join)
+{
+	struct Loader *loader = &widget->loader;
+
+	if (!loader->started)
+		return;
+	if (join) {
+		(void)pthread_mutex_lock(&loader->mutex);
+		loader->stop = true;
+		(void)pthread_cond_signal(&loader->cond);
+		(void)pthread_mutex_unlock(&loader->mutex);
+		(void)pthread_join(loader->thread, NULL);
+	}
+	close(loader->pipefd[0]);
+	close(loader->pipefd[1]);
+	loader->started = false;
+}
+
+static void
+freechrome(Widget *widget)
+{
+	struct Chrome *chrome = &widget->chrome;
+
+	if (chrome->dash != None)
+		XRenderFreePicture(widget->display, chrome->dash);
+	if (chrome->separator != None)
+		XRenderFreePicture(widget->display, chrome->separator);
+	if (chrome->arrows != None)
+		XRenderFreePicture(widget->display, chrome->arrows);
+	if (chrome->dashpix != None)
+		XFreePixmap(widget->display, chrome->dashpix);
+	if (chrome->seppix != None)
+		XFreePixmap(widget->display, chrome->seppix);
+	if (chrome->arrowpix != None)
+		XFreePixmap(widget->display, chrome->arrowpix);
+}
+
+static void
+freecanvases(Widget *widget, struct Canvas canvas[])
+{
+	size_t i;
+
+	for (i = 0; i < CANVAS_LAST; i++) {
+		if (canvas[i].picture != None)
+			XRenderFreePicture(widget->display, canvas[i].picture);
+		if (canvas[i].pixmap != None)
+			XFreePixmap(widget->display, canvas[i].pixmap);
+		canvas[i].picture = None;
+		canvas[i].pixmap = None;
+	}
+}
+
 static void
 cleanup(Widget *widget)
 {
@@ -1150,6 +1616,23 @@ cleanup(Widget *widget)
 
 	if (widget->fontset != NULL)
 		ctrlfnt_free(widget->fontset);
+	stoploader(widget, true);
+	if (widget->atlas.picture != None)
+		XRenderFreePicture(widget->display, widget->atlas.picture);
+	if (widget->atlas.pixmap != None)
+		XFreePixmap(widget->display, widget->atlas.pixmap);
+	if (widget->atlas.gc != NULL)
+		XFreeGC(widget->display, widget->atlas.gc);
+	cleanicons(widget);
+	for (i = 0; i < CANVAS_FINAL; i++)
+		free(widget->labels.texts[i]);
+	freechrome(widget);
+	if (widget->gc != NULL)
+		XFreeGC(widget->display, widget->gc);
+	for (i = 0; i < widget->pool.nentries; i++) {
+		freecanvases(widget, widget->pool.entries[i].canvas);
+		XDestroyWindow(widget->display, widget->pool.entries[i].window);
+	}
 	for (i = 0; i < SCHEME_LAST; i++) for (j = 0; j < COLOR_LAST; j++) {
 		if (widget->colors[i][j].pict != None) {
 			XRenderFreePicture(
@@ -1276,128 +1759,7 @@ grabkeyboard(Widget *widget)
 }
 
 static void
-drawshadows(Widget *widget, Picture picture, XRectangle *geometry)
-{
-	int i;
-
-	for(i = 0; i < widget->shadowwid; i++) {
-		/* draw light shadow */
-		XRenderFillRectangle(
-			widget->display,
-			PictOpSrc,
-			picture,
-			&widget->colors[SCHEME_SHADOW][COLOR_TOP].chans,
-			i, i,
-			1, geometry->height - (i * 2 + 1)
-		);
-		XRenderFillRectangle(
-			widget->display,
-			PictOpSrc,
-			picture,
-			&widget->colors[SCHEME_SHADOW][COLOR_TOP].chans,
-			i, i,
-			geometry->width - (i * 2 + 1), 1
-		);
-
-		/* draw dark shadow */
-		XRenderFillRectangle(
-			widget->display,
-			PictOpSrc,
-			picture,
-			&widget->colors[SCHEME_SHADOW][COLOR_BOT].chans,
-			geometry->width - 1 - i, i,
-			1, geometry->height - i * 2
-		);
-		XRenderFillRectangle(
-			widget->display,
-			PictOpSrc,
-			picture,
-			&widget->colors[SCHEME_SHADOW][COLOR_BOT].chans,
-			i, geometry->height - 1 - i,
-			geometry->width - i * 2, 1
-		);
-	}
-}
-
-static void
-drawdashline(Widget *widget, Picture picture, int width, int y)
-{
-	XRectangle toprects[32];
-	XRectangle botrects[32];
-	size_t i, nrects;
-	int x;
-	int w;
-	int maxw;
-
-	x = widget->shadowwid + PADDING;
-	y += widget->separatorh / 2;
-	w = 0;
-	maxw = width - widget->shadowwid * 2 - PADDING * 2;
-	while (w < maxw) {
-		nrects = 0;
-		for (i = 0; i < LEN(toprects); i++) {
-			static int const DASH_SIZE = 8;
-			if (w >= maxw)
-				break;
-			toprects[i].x = x + w;
-			toprects[i].y = y - 1;
-			toprects[i].width = DASH_SIZE;
-			toprects[i].height = 1;
-			botrects[i].x = x + w;
-			botrects[i].y = y;
-			botrects[i].width = DASH_SIZE;
-			botrects[i].height = 1;
-			w += DASH_SIZE * 2;
-			nrects++;
-		}
-		for (i = 0; i < nrects; i++) {
-			XRenderFillRectangles(
-				widget->display,
-				PictOpSrc,
-				picture,
-				&widget->colors[SCHEME_SHADOW][COLOR_TOP].chans,
-				toprects,
-				nrects
-			);
-			XRenderFillRectangles(
-				widget->display,
-				PictOpSrc,
-				picture,
-				&widget->colors[SCHEME_SHADOW][COLOR_BOT].chans,
-				botrects,
-				nrects
-			);
-		}
-	}
-}
-
-static void
-drawseparator(Widget *widget, Picture picture, XRectangle *rect)
-{
-	XRenderFillRectangle(
-		widget->display,
-		PictOpSrc,
-		picture,
-		&widget->colors[SCHEME_SHADOW][COLOR_BOT].chans,
-		widget->shadowwid + PADDING,
-		rect->y + widget->separatorh / 2 - 1,
-		rect->width - widget->shadowwid * 2 - PADDING * 2,
-		1
-	);
-	XRenderFillRectangle(
-		widget->display,
-		PictOpSrc,
-		picture,
-		&widget->colors[SCHEME_SHADOW][COLOR_TOP].chans,
-		widget->shadowwid + PADDING,
-		rect->y + widget->separatorh / 2,
-		rect->width - widget->shadowwid * 2 - PADDING * 2,
-		1
-	);
-}
-
-static void
-drawtriangle(Widget *widget, Picture picture, Picture src, int x, int y, int direction)
+rasterarrow(Widget *widget, Picture src, int x, int y, int direction)
 {
 	XTriangle triangle;
 
@@ -1458,7 +1820,7 @@ drawtriangle(Widget *widget, Picture picture, Picture src, int x, int y, int dir
 		widget->display,
 		PictOpOver,
 		src,
-		picture,
+		widget->chrome.arrows,
 		widget->alphaformat,
 		0, 0,
 		&triangle,
@@ -1466,139 +1828,931 @@ drawtriangle(Widget *widget, Picture picture, Picture src, int x, int y, int dir
 	);
 }
 
-static bool
-cantearoff(Widget *widget, Menu *menu)
-{
-	return (menu->next != NULL || !options.windowed) && widget->tearoff;
-}
-
-static int
-firstitempos(Widget *widget, Menu *menu)
+static Picture
+createtile(Widget *widget, Pixmap *pixmap, int width, int height,
+           XRenderPictFormat *format)
 {
-	int y;
-
-	y = widget->shadowwid;
-	if (cantearoff(widget, menu))
-		y += widget->separatorh;
-	if (menu->overflow)
-		y += widget->separatorh;
-	return y;
+	*pixmap = XCreatePixmap(
+		widget->display,
+		widget->window,
+		width, height,
+		format->depth
+	);
+	return XRenderCreatePicture(
+		widget->display,
+		*pixmap,
+		format,
+		CPRepeat,
+		&(XRenderPictureAttributes){
+			.repeat = RepeatNormal,
+		}
+	);
 }
 
 static void
-initimlib(Widget *widget)
-{
-	if (widget->initimlib)
-		return;
-	widget->initimlib = true;
-	imlib_set_cache_size(2048 * 1024);
-	imlib_context_set_dither(1);
-	imlib_context_set_blend(0);
-	imlib_context_set_display(widget->display);
-	imlib_context_set_visual(widget->visual);
-	imlib_context_set_colormap(widget->colormap);
-}
-
-static bool
-isabsolute(const char *s)
-{
-	if (s[0] == '/')
-		return true;
-	if (s[0] == '.' && (s[1] == '/' || (s[1] == '.' && s[2] == '/')))
-		return true;
-	return false;
-}
-
-static Imlib_Image
-loadicon(Widget *widget, const char *file, int size, int *width_ret, int *height_ret)
+buildchrome(Widget *widget)
 {
-	Imlib_Image icon = NULL;
-	Imlib_Load_Error errcode;
-	char path[PATH_MAX];
-	const char *errstr;
-	int width;
-	int height;
-	size_t i;
+	struct Chrome *chrome = &widget->chrome;
+	XRenderColor *top = &widget->colors[SCHEME_SHADOW][COLOR_TOP].chans;
+	XRenderColor *bot = &widget->colors[SCHEME_SHADOW][COLOR_BOT].chans;
+	Picture white;
+	int i;
 
-	if (file == NULL)
-		return NULL;
-	if (*file == '\0') {
-		warnx("could not load icon (file name is blank)");
-		return NULL;
+	/* the arrows are masks and do not depend on the theme */
+	if (chrome->arrows == None) {
+		chrome->arrows = createtile(
+			widget,
+			&chrome->arrowpix,
+			ARROW_CELL * 4, ARROW_CELL,
+			widget->alphaformat
+		);
+		XRenderFillRectangle(
+			widget->display,
+			PictOpClear,
+			chrome->arrows,
+			&(XRenderColor){ 0 },
+			0, 0,
+			ARROW_CELL * 4, ARROW_CELL
+		);
+		white = XRenderCreateSolidFill(
+			widget->display,
+			&(XRenderColor){ .alpha = 0xFFFF }
+		);
+		for (i = DIR_UP; i <= DIR_RIGHT; i++) {
+			rasterarrow(
+				widget,
+				white,
+				i * ARROW_CELL + (i == DIR_LEFT ? TRIANGLE_WIDTH : 0),
+				0,
+				i
+			);
+		}
+		XRenderFreePicture(widget->display, white);
 	}
-	initimlib(widget);
-	if (isabsolute(file))
-		icon = imlib_load_image_with_error_return(file, &errcode);
-	else {
-		for (i = 0; i < options.niconpaths; i++) {
-			snprintf(path, sizeof(path), "%s/%s", options.iconpaths[i], file);
-			icon = imlib_load_image_with_error_return(path, &errcode);
-			if (icon != NULL || errcode != IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST) {
-				break;
-			}
+
+	/* a dash followed by a gap, over the two lines of the dash line */
+	if (chrome->dash == None) {
+		chrome->dash = createtile(
+			widget,
+			&chrome->dashpix,
+			DASH_SIZE * 2, 2,
+			widget->argbformat
+		);
+	}
+	XRenderFillRectangle(
+		widget->display,
+		PictOpClear,
+		chrome->dash,
+		&(XRenderColor){ 0 },
+		0, 0,
+		DASH_SIZE * 2, 2
+	);
+	XRenderFillRectangle(
+		widget->display,
+		PictOpSrc,
+		chrome->dash,
+		top,
+		0, 0,
+		DASH_SIZE, 1
+	);
+	XRenderFillRectangle(
+		widget->display,
+		PictOpSrc,
+		chrome->dash,
+		bot,
+		0, 1,
+		DASH_SIZE, 1
+	);
+
+	/* the dark line above the light line of the separator */
+	if (chrome->separator == None) {
+		chrome->separator = createtile(
+			widget,
+			&chrome->seppix,
+			1, 2,
+			widget->argbformat
+		);
+	}
+	XRenderFillRectangle(
+		widget->display,
+		PictOpSrc,
+		chrome->separator,
+		bot,
+		0, 0, 1, 1
+	);
+	XRenderFillRectangle(
+		widget->display,
+		PictOpSrc,
+		chrome->separator,
+		top,
+		0, 1, 1, 1
+	);
+	chrome->stale = false;
+}
+
+static void
+drawshadows(Widget *widget, Picture picture, XRectangle *geometry)
+{
+	XRectangle toprects[32];
+	XRectangle botrects[32];
+	size_t nrects;
+	int i;
+
+	/*
+	 * The light and dark rectangles never overlap, so each color
+	 * goes in a single request, whatever the shadow width.
+	 */
+	for (i = 0; i < widget->shadowwid; ) {
+		for (nrects = 0; nrects < LEN(toprects) &&
+		     i < widget->shadowwid; nrects += 2, i++) {
+			toprects[nrects] = (XRectangle){
+				i, i,
+				1, geometry->height - (i * 2 + 1)
+			};
+			toprects[nrects + 1] = (XRectangle){
+				i, i,
+				geometry->width - (i * 2 + 1), 1
+			};
+			botrects[nrects] = (XRectangle){
+				geometry->width - 1 - i, i,
+				1, geometry->height - i * 2
+			};
+			botrects[nrects + 1] = (XRectangle){
+				i, geometry->height - 1 - i,
+				geometry->width - i * 2, 1
+			};
 		}
+		XRenderFillRectangles(
+			widget->display,
+			PictOpSrc,
+			picture,
+			&widget->colors[SCHEME_SHADOW][COLOR_TOP].chans,
+			toprects,
+			nrects
+		);
+		XRenderFillRectangles(
+			widget->display,
+			PictOpSrc,
+			picture,
+			&widget->colors[SCHEME_SHADOW][COLOR_BOT].chans,
+			botrects,
+			nrects
+		);
 	}
-	if (icon == NULL) {
-		switch (errcode) {
-		case IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST:
-			errstr = "file does not exist";
-			break;
-		case IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY:
-			errstr = "file is directory";
-			break;
-		case IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ:
-		case IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE:
-			errstr = "permission denied";
-			break;
-		case IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT:
-			errstr = "unknown file format";
-			break;
-		case IMLIB_LOAD_ERROR_PATH_TOO_LONG:
-			errstr = "path too long";
-			break;
-		case IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT:
-		case IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY:
-		case IMLIB_LOAD_ERROR_PATH_POINTS_OUTSIDE_ADDRESS_SPACE:
-			errstr = "improper path";
-			break;
-		case IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS:
-			errstr = "too many symbolic links";
-			break;
-		case IMLIB_LOAD_ERROR_OUT_OF_MEMORY:
-			errstr = "out of memory";
-			break;
-		case IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS:
-			errstr = "out of file descriptors";
-			break;
-		default:
-			errstr = "unknown error";
-			break;
+}
+
+static void
+drawdashline(Widget *widget, Picture picture, int width, int y)
+{
+	XRenderComposite(
+		widget->display,
+		PictOpOver,
+		widget->chrome.dash,
+		None,
+		picture,
+		0, 0,
+		0, 0,
+		widget->shadowwid + PADDING,
+		y + widget->separatorh / 2 - 1,
+		width - widget->shadowwid * 2 - PADDING * 2,
+		2
+	);
+}
+
+static void
+drawseparator(Widget *widget, Picture picture, XRectangle *rect)
+{
+	XRenderComposite(
+		widget->display,
+		PictOpSrc,
+		widget->chrome.separator,
+		None,
+		picture,
+		0, 0,
+		0, 0,
+		widget->shadowwid + PADDING,
+		rect->y + widget->separatorh / 2 - 1,
+		rect->width - widget->shadowwid * 2 - PADDING * 2,
+		2
+	);
+}
+
+static void
+drawtriangle(Widget *widget, Picture picture, Picture src, int x, int y, int direction)
+{
+	XRenderComposite(
+		widget->display,
+		PictOpOver,
+		src,
+		widget->chrome.arrows,
+		picture,
+		0, 0,
+		direction * ARROW_CELL, 0,
+		x - (direction == DIR_LEFT ? TRIANGLE_WIDTH : 0), y,
+		ARROW_CELL, ARROW_CELL
+	);
+}
+
+static bool
+cantearoff(Widget *widget, Menu *menu)
+{
+	return (menu->next != NULL || !options.windowed) && widget->tearoff;
+}
+
+static int
+firstitempos(Widget *widget, Menu *menu)
+{
+	int y;
+
+	y = widget->shadowwid;
+	if (cantearoff(widget, menu))
+		y += widget->separatorh;
+	if (menu->overflow)
+		y += widget->separatorh;
+	return y;
+}
+
+static void
+initimlib(Widget *widget)
+{
+	if (widget->initimlib)
+		return;
+	widget->initimlib = true;
+	/* scaled icons are cached by geticon(), not the originals */
+	imlib_set_cache_size(0);
+	imlib_context_set_anti_alias(1);
+}
+
+static bool
+isabsolute(const char *s)
+{
+	if (s[0] == '/')
+		return true;
+	if (s[0] == '.' && (s[1] == '/' || (s[1] == '.' && s[2] == '/')))
+		return true;
+	return false;
+}
+
+static int
+probeicon(size_t dir, const char *file, char *path, size_t size, struct stat *sb)
+{
+	(void)snprintf(path, size, "%s/%s", options.iconpaths[dir], file);
+	return stat(path, sb);
+}
+
+static int
+findicon(const char *file, char *path, size_t size, struct stat *sb)
+{
+	size_t i, dir;
+	bool indexed;
+
+	if (isabsolute(file)) {
+		(void)snprintf(path, size, "%s", file);
+		return stat(path, sb);
+	}
+
+	/*
+	 * Plain file names are looked up in the index of ICONPATH, so
+	 * only directories that could not be listed are still probed.
+	 * Names with a directory part are probed in every directory.
+	 */
+	indexed = strchr(file, '/') == NULL;
+	dir = indexed ? lookupicondir(file) : options.niconpaths;
+	for (i = 0; i < dir; i++) {
+		if (indexed && !options.iconunindexed[i])
+			continue;
+		if (probeicon(i, file, path, size, sb) == RETURN_SUCCESS)
+			return RETURN_SUCCESS;
+		if (errno != ENOENT)
+			return RETURN_FAILURE;
+	}
+	if (dir == options.niconpaths) {
+		errno = ENOENT;
+		return RETURN_FAILURE;
+	}
+	if (probeicon(dir, file, path, size, sb) == RETURN_SUCCESS)
+		return RETURN_SUCCESS;
+
+	/* the index is stale; search the directories after it the old way */
+	for (i = dir + 1; i < options.niconpaths; i++) {
+		if (errno != ENOENT)
+			return RETURN_FAILURE;
+		if (probeicon(i, file, path, size, sb) == RETURN_SUCCESS)
+			return RETURN_SUCCESS;
+	}
+	return RETURN_FAILURE;
+}
+
+static bool
+thumbnailpath(char *buf, size_t size, const char *path, int iconsize)
+{
+	int n;
+
+	if (options.cachedir == NULL)
+		return false;
+	n = snprintf(
+		buf, size, "%s/%0*lx-%d",
+		options.cachedir,
+		(int)sizeof(unsigned long) * 2,
+		hashstr(path),
+		iconsize
+	);
+	return n > 0 && (size_t)n < size;
+}
+
+static bool
+readthumbnail(Icon *icon, const char *path, struct stat *sb)
+{
+	struct Thumbnail *thumb;
+	struct stat tsb;
+	char buf[PATH_MAX];
+	size_t pathlen, offset;
+	void *map;
+	int fd;
+
+	if (!thumbnailpath(buf, sizeof(buf), path, icon->size))
+		return false;
+	if ((fd = open(buf, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &tsb) == -1 || (size_t)tsb.st_size < sizeof(*thumb)) {
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, tsb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	thumb = map;
+	pathlen = strlen(path);
+	offset = sizeof(*thumb) + THUMB_ALIGN(pathlen);
+	if (memcmp(thumb->magic, THUMB_MAGIC, sizeof(thumb->magic)) != 0 ||
+	    thumb->byteorder != THUMB_BYTEORDER ||
+	    thumb->size != (uint32_t)icon->size ||
+	    thumb->width == 0 || thumb->width > (uint32_t)icon->size ||
+	    thumb->height == 0 || thumb->height > (uint32_t)icon->size ||
+	    thumb->mtime != (int64_t)sb->st_mtim.tv_sec ||
+	    thumb->mtimensec != (int64_t)sb->st_mtim.tv_nsec ||
+	    thumb->filesize != (int64_t)sb->st_size ||
+	    thumb->pathlen != pathlen ||
+	    (size_t)tsb.st_size != offset +
+	    (size_t)thumb->width * thumb->height * sizeof(uint32_t) ||
+	    memcmp((char *)map + sizeof(*thumb), path, pathlen) != 0) {
+		/* stale, foreign or colliding entry; it will be rewritten */
+		munmap(map, tsb.st_size);
+		return false;
+	}
+	icon->map = map;
+	icon->mapsize = tsb.st_size;
+	icon->width = thumb->width;
+	icon->height = thumb->height;
+	icon->pixels = (uint32_t *)((char *)map + offset);
+	return true;
+}
+
+static bool
+writeall(int fd, const void *buf, size_t size)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = write(fd, p, size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
 		}
-		warnx("could not load icon (%s): %s", errstr, file);
-		return NULL;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static void
+makedirs(const char *dir)
+{
+	char path[PATH_MAX];
+	char *s;
+
+	(void)snprintf(path, sizeof(path), "%s", dir);
+	for (s = path + 1; *s != '\0'; s++) {
+		if (*s != '/')
+			continue;
+		*s = '\0';
+		(void)mkdir(path, 0700);
+		*s = '/';
+	}
+	(void)mkdir(path, 0700);
+}
+
+static void
+writethumbnail(Icon *icon, const char *path, struct stat *sb)
+{
+	static const char zeros[4] = { 0 };
+	struct Thumbnail thumb;
+	char buf[PATH_MAX];
+	char tmp[PATH_MAX];
+	size_t pathlen;
+	bool success;
+	int fd;
+
+	if (!thumbnailpath(buf, sizeof(buf), path, icon->size))
+		return;
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", buf) >= (int)sizeof(tmp))
+		return;
+	if ((fd = mkstemp(tmp)) == -1 && errno == ENOENT) {
+		makedirs(options.cachedir);
+		memcpy(tmp + strlen(buf), ".XXXXXX", sizeof(".XXXXXX"));
+		fd = mkstemp(tmp);
+	}
+	if (fd == -1)
+		return;
+	pathlen = strlen(path);
+	memset(&thumb, 0, sizeof(thumb));
+	memcpy(thumb.magic, THUMB_MAGIC, sizeof(thumb.magic));
+	thumb.byteorder = THUMB_BYTEORDER;
+	thumb.size = icon->size;
+	thumb.width = icon->width;
+	thumb.height = icon->height;
+	thumb.mtime = sb->st_mtim.tv_sec;
+	thumb.mtimensec = sb->st_mtim.tv_nsec;
+	thumb.filesize = sb->st_size;
+	thumb.pathlen = pathlen;
+	success = writeall(fd, &thumb, sizeof(thumb)) &&
+	          writeall(fd, path, pathlen) &&
+	          writeall(fd, zeros, THUMB_ALIGN(pathlen) - pathlen) &&
+	          writeall(fd, icon->pixels, (size_t)icon->width *
+	                   icon->height * sizeof(*icon->pixels));
+	if (close(fd) == -1)
+		success = false;
+	if (!success || rename(tmp, buf) == -1) {
+		(void)unlink(tmp);
+	}
+}
+
+static int
+loadicon(Widget *widget, Icon *icon)
+{
+	Imlib_Image image;
+	Imlib_Load_Error errcode;
+	struct stat sb;
+	DATA32 *data;
+	uint32_t a, r, g, b;
+	size_t i, n;
+	bool hasalpha;
+	char path[PATH_MAX];
+	const char *errstr;
+	int width;
+	int height;
+	bool found;
+
+	if (icon->file[0] == '\0') {
+		warnx("could not load icon (file name is blank)");
+		return RETURN_FAILURE;
+	}
+	found = findicon(icon->file, path, sizeof(path), &sb) == RETURN_SUCCESS;
+	if (found) {
+		if (readthumbnail(icon, path, &sb))
+			return RETURN_SUCCESS;
+	} else if (errno == ENOENT) {
+		errcode = IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST;
+		goto error;
 	}
+	initimlib(widget);
+	image = imlib_load_image_with_error_return(path, &errcode);
+	if (image == NULL)
+		goto error;
 
-	imlib_context_set_image(icon);
+	imlib_context_set_image(image);
 
 	width = imlib_image_get_width();
 	height = imlib_image_get_height();
 
 	if (width > height) {
-		*width_ret = size;
-		*height_ret = (height * size) / width;
+		icon->width = icon->size;
+		icon->height = MAX((height * icon->size) / width, 1);
 	} else {
-		*width_ret = (width * size) / height;
-		*height_ret = size;
+		icon->width = MAX((width * icon->size) / height, 1);
+		icon->height = icon->size;
 	}
 
-	icon = imlib_create_cropped_scaled_image(
+	image = imlib_create_cropped_scaled_image(
 		0, 0,
 		width, height,
-		*width_ret, *height_ret
+		icon->width, icon->height
+	);
+	imlib_free_image_and_decache();
+	if (image == NULL)
+		return RETURN_FAILURE;
+
+	/* convert into premultiplied ARGB, as XRender wants */
+	imlib_context_set_image(image);
+	hasalpha = imlib_image_has_alpha();
+	data = imlib_image_get_data_for_reading_only();
+	n = (size_t)icon->width * icon->height;
+	icon->pixels = emalloc(n * sizeof(*icon->pixels));
+	for (i = 0; i < n; i++) {
+		a = hasalpha ? (data[i] >> 24) & 0xFF : 0xFF;
+		r = (((data[i] >> 16) & 0xFF) * a + 127) / 255;
+		g = (((data[i] >> 8) & 0xFF) * a + 127) / 255;
+		b = ((data[i] & 0xFF) * a + 127) / 255;
+		icon->pixels[i] = a << 24 | r << 16 | g << 8 | b;
+	}
+	imlib_free_image();
+	if (found)
+		writethumbnail(icon, path, &sb);
+	return RETURN_SUCCESS;
+error:
+	switch (errcode) {
+	case IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST:
+		errstr = "file does not exist";
+		break;
+	case IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY:
+		errstr = "file is directory";
+		break;
+	case IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ:
+	case IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE:
+		errstr = "permission denied";
+		break;
+	case IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT:
+		errstr = "unknown file format";
+		break;
+	case IMLIB_LOAD_ERROR_PATH_TOO_LONG:
+		errstr = "path too long";
+		break;
+	case IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT:
+	case IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY:
+	case IMLIB_LOAD_ERROR_PATH_POINTS_OUTSIDE_ADDRESS_SPACE:
+		errstr = "improper path";
+		break;
+	case IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS:
+		errstr = "too many symbolic links";
+		break;
+	case IMLIB_LOAD_ERROR_OUT_OF_MEMORY:
+		errstr = "out of memory";
+		break;
+	case IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS:
+		errstr = "out of file descriptors";
+		break;
+	default:
+		errstr = "unknown error";
+		break;
+	}
+	warnx("could not load icon (%s): %s", errstr, icon->file);
+	return RETURN_FAILURE;
+}
+
+static void
+resetatlas(Widget *widget, int cellsize)
+{
+	struct Atlas *atlas = &widget->atlas;
+	Icon *icon;
+
+	if (atlas->picture != None)
+		XRenderFreePicture(widget->display, atlas->picture);
+	if (atlas->pixmap != None)
+		XFreePixmap(widget->display, atlas->pixmap);
+	atlas->picture = None;
+	atlas->pixmap = None;
+	atlas->cellsize = cellsize;
+	atlas->ncells = 0;
+	atlas->nused = 0;
+	atlas->nfree = 0;
+	for (icon = widget->icons.head; icon != NULL; icon = icon->next) {
+		icon->cell = -1;
+	}
+}
+
+static int
+growatlas(Widget *widget)
+{
+	struct Atlas *atlas = &widget->atlas;
+	Pixmap pixmap;
+	Picture picture;
+	int *freecells;
+	int ncells;
+
+	ncells = atlas->ncells > 0 ? atlas->ncells * 2 : ATLAS_CELLS;
+	freecells = realloc(atlas->freecells, ncells * sizeof(*freecells));
+	if (freecells == NULL) {
+		warn("realloc");
+		return RETURN_FAILURE;
+	}
+	atlas->freecells = freecells;
+	pixmap = XCreatePixmap(
+		widget->display,
+		widget->window,
+		ATLAS_COLUMNS * atlas->cellsize,
+		ncells / ATLAS_COLUMNS * atlas->cellsize,
+		32
+	);
+	if (pixmap == None) {
+		warnx("could not create pixmap");
+		return RETURN_FAILURE;
+	}
+	picture = XRenderCreatePicture(
+		widget->display,
+		pixmap,
+		widget->argbformat,
+		0,
+		NULL
+	);
+	if (picture == None) {
+		XFreePixmap(widget->display, pixmap);
+		warnx("could not create picture");
+		return RETURN_FAILURE;
+	}
+	if (atlas->gc == NULL)
+		atlas->gc = XCreateGC(widget->display, pixmap, 0, NULL);
+	if (atlas->picture != None) {
+		XRenderComposite(
+			widget->display,
+			PictOpSrc,
+			atlas->picture,
+			None,
+			picture,
+			0, 0,
+			0, 0,
+			0, 0,
+			ATLAS_COLUMNS * atlas->cellsize,
+			atlas->ncells / ATLAS_COLUMNS * atlas->cellsize
+		);
+		XRenderFreePicture(widget->display, atlas->picture);
+		XFreePixmap(widget->display, atlas->pixmap);
+	}
+	atlas->pixmap = pixmap;
+	atlas->picture = picture;
+	atlas->ncells = ncells;
+	return RETURN_SUCCESS;
+}
+
+static int
+uploadicon(Widget *widget, Icon *icon)
+{
+	struct Atlas *atlas = &widget->atlas;
+	XImage *ximage;
+	unsigned int one = 1;
+
+	if (icon->cell >= 0)
+		return RETURN_SUCCESS;
+	if (icon->pixels == NULL)
+		return RETURN_FAILURE;
+	if (atlas->cellsize != widget->iconsize)
+		resetatlas(widget, widget->iconsize);
+	if (icon->width > atlas->cellsize || icon->height > atlas->cellsize)
+		return RETURN_FAILURE;
+	if (atlas->nfree > 0) {
+		icon->cell = atlas->freecells[--atlas->nfree];
+	} else {
+		if (atlas->nused == atlas->ncells &&
+		    growatlas(widget) == RETURN_FAILURE)
+			return RETURN_FAILURE;
+		icon->cell = atlas->nused++;
+	}
+	ximage = XCreateImage(
+		widget->display,
+		NULL,
+		32,
+		ZPixmap,
+		0,
+		(char *)icon->pixels,
+		icon->width,
+		icon->height,
+		32,
+		0
+	);
+	if (ximage == NULL) {
+		atlas->freecells[atlas->nfree++] = icon->cell;
+		icon->cell = -1;
+		return RETURN_FAILURE;
+	}
+	/* the pixels are in host byte order; let Xlib swap them if needed */
+	ximage->byte_order = *(unsigned char *)&one ? LSBFirst : MSBFirst;
+	XPutImage(
+		widget->display,
+		atlas->pixmap,
+		atlas->gc,
+		ximage,
+		0, 0,
+		icon->cell % ATLAS_COLUMNS * atlas->cellsize,
+		icon->cell / ATLAS_COLUMNS * atlas->cellsize,
+		icon->width,
+		icon->height
 	);
+	ximage->data = NULL;
+	XDestroyImage(ximage);
+	return RETURN_SUCCESS;
+}
+
+static void
+evicticons(Widget *widget, Icon *keep)
+{
+	struct IconCache *cache = &widget->icons;
+	Icon *icon, *prev, **p;
+
+	for (icon = cache->tail;
+	     icon != NULL && cache->nbytes > cache->maxbytes;
+	     icon = prev) {
+		prev = icon->prev;
+		if (icon == keep || icon->pending)
+			continue;
+		if (icon->prev != NULL)
+			icon->prev->next = icon->next;
+		else
+			cache->head = icon->next;
+		if (icon->next != NULL)
+			icon->next->prev = icon->prev;
+		else
+			cache->tail = icon->prev;
+		p = &cache->buckets[(hashstr(icon->file) + icon->size) % ICON_BUCKETS];
+		while (*p != icon)
+			p = &(*p)->hnext;
+		*p = icon->hnext;
+		cache->nbytes -= icon->nbytes;
+		freeicon(widget, icon);
+	}
+}
+
+static void *
+iconloader(void *arg)
+{
+	Widget *widget = arg;
+	struct Loader *loader = &widget->loader;
+	Icon *icon;
+
+	(void)pthread_mutex_lock(&loader->mutex);
+	for (;;) {
+		while (loader->queue == NULL && !loader->stop)
+			(void)pthread_cond_wait(&loader->cond, &loader->mutex);
+		if (loader->stop)
+			break;
+		icon = loader->queue;
+		loader->queue = icon->qnext;
+		(void)pthread_mutex_unlock(&loader->mutex);
+
+		/* only this thread calls Imlib2 and touches the file system */
+		(void)loadicon(widget, icon);
+
+		(void)pthread_mutex_lock(&loader->mutex);
+		icon->qnext = loader->done;
+		loader->done = icon;
+		while (write(loader->pipefd[1], "", 1) == -1 && errno == EINTR)
+			;
+	}
+	(void)pthread_mutex_unlock(&loader->mutex);
+	return NULL;
+}
+
+static int
+initloader(Widget *widget)
+{
+	struct Loader *loader = &widget->loader;
+	int i, flags;
+
+	if (pipe(loader->pipefd) == -1) {
+		warn("pipe");
+		return RETURN_FAILURE;
+	}
+	for (i = 0; i < 2; i++) {
+		flags = fcntl(loader->pipefd[i], F_GETFL);
+		(void)fcntl(loader->pipefd[i], F_SETFL, flags | O_NONBLOCK);
+		(void)fcntl(loader->pipefd[i], F_SETFD, FD_CLOEXEC);
+	}
+	(void)pthread_mutex_init(&loader->mutex, NULL);
+	(void)pthread_cond_init(&loader->cond, NULL);
+	if ((errno = pthread_create(&loader->thread, NULL, iconloader, widget)) != 0) {
+		warn("pthread_create");
+		close(loader->pipefd[0]);
+		close(loader->pipefd[1]);
+		return RETURN_FAILURE;
+	}
+	loader->started = true;
+	return RETURN_SUCCESS;
+}
+
+static void
+queueicon(Widget *widget, Icon *icon)
+{
+	struct Loader *loader = &widget->loader;
+
+	(void)pthread_mutex_lock(&loader->mutex);
+	icon->qnext = NULL;
+	if (loader->queue == NULL)
+		loader->queue = icon;
+	else
+		loader->queuetail->qnext = icon;
+	loader->queuetail = icon;
+	(void)pthread_cond_signal(&loader->cond);
+	(void)pthread_mutex_unlock(&loader->mutex);
+}
+
+static Icon *
+geticon(Widget *widget, const char *file, int size)
+{
+	struct IconCache *cache = &widget->icons;
+	Icon *icon;
+	size_t bucket;
+
+	if (file == NULL)
+		return NULL;
+	bucket = (hashstr(file) + size) % ICON_BUCKETS;
+	for (icon = cache->buckets[bucket]; icon != NULL; icon = icon->hnext)
+		if (icon->size == size && strcmp(icon->file, file) == 0)
+			break;
+	if (icon == NULL) {
+		/* failed loads are cached too, so we do not retry them */
+		icon = emalloc(sizeof(*icon));
+		*icon = (Icon){
+			.hnext = cache->buckets[bucket],
+			.file = estrdup(file),
+			.size = size,
+			.cell = -1,
+			.pending = true,
+		};
+		icon->nbytes = sizeof(*icon) + strlen(file) + 1;
+		cache->buckets[bucket] = icon;
+		cache->nbytes += icon->nbytes;
+		queueicon(widget, icon);
+	} else if (icon == cache->head) {
+		return icon;
+	} else {
+		/* unlink from LRU list */
+		icon->prev->next = icon->next;
+		if (icon->next != NULL)
+			icon->next->prev = icon->prev;
+		else
+			cache->tail = icon->prev;
+	}
+	icon->prev = NULL;
+	icon->next = cache->head;
+	if (cache->head != NULL)
+		cache->head->prev = icon;
+	else
+		cache->tail = icon;
+	cache->head = icon;
+	evicticons(widget, icon);
 	return icon;
 }
 
+static int
+labelwidth(Widget *widget, Item *item)
+{
+	if (item->textgen != widget->fontgen) {
+		ctrlfnt_layout_free(item->layout);
+		item->layout = ctrlfnt_layout_open(
+			widget->fontset,
+			item->label,
+			item->labellen
+		);
+		if (item->layout != NULL) {
+			item->textw = ctrlfnt_layout_width(item->layout);
+		} else {
+			item->textw = ctrlfnt_width(
+				widget->fontset,
+				item->label,
+				item->labellen
+			);
+		}
+		item->textgen = widget->fontgen;
+	}
+	return item->textw;
+}
+
+static bool
+reservelabel(Widget *widget)
+{
+	struct Labels *labels = &widget->labels;
+	struct ctrlfnt_text *texts;
+	size_t i, size;
+
+	if (labels->ntexts < labels->size)
+		return true;
+	size = labels->size == 0 ? 64 : labels->size * 2;
+	for (i = 0; i < CANVAS_FINAL; i++) {
+		texts = realloc(labels->texts[i], size * sizeof(*texts));
+		if (texts == NULL)
+			return false;
+		labels->texts[i] = texts;
+	}
+	labels->size = size;
+	return true;
+}
+
+static void
+flushlabels(Widget *widget, Menu *menu)
+{
+	size_t i;
+
+	for (i = 0; i < CANVAS_FINAL; i++) {
+		(void)ctrlfnt_draw_many(
+			widget->fontset,
+			menu->canvas[i].picture,
+			widget->labels.texts[i],
+			widget->labels.ntexts
+		);
+	}
+	widget->labels.ntexts = 0;
+}
+
 static bool
 openssubmenu(Item *item)
 {
@@ -1610,29 +2764,27 @@ openssubmenu(Item *item)
 }
 
 static void
-drawmenu(Widget *widget, Menu *menu)
+alloccanvases(Widget *widget, Menu *menu)
 {
-	Item *item;
-	size_t i, j;
-	Imlib_Image image;
-	XRectangle rect;
-	int textx, textw, iconw, iconh, y;
-	struct Canvas canvas[CANVAS_FINAL][LAYER_LAST];
-
+	size_t i;
+	int w, h;
+
+	/*
+	 * Canvases are allocated in steps of CANVAS_BUCKET pixels, so
+	 * that small changes of size, or a pooled window reused for a
+	 * menu of about the same size, keep the pixmaps already there.
+	 */
+	w = ROUNDUP(menu->geometry.width, CANVAS_BUCKET);
+	h = ROUNDUP(menu->geometry.height, CANVAS_BUCKET);
+	if (menu->canvas[0].pixmap != None &&
+	    w == menu->pixmapw && h == menu->pixmaph)
+		goto done;
+	freecanvases(widget, menu->canvas);
 	for (i = 0; i < CANVAS_LAST; i++) {
-		if (menu->canvas[i].picture != None) {
-			XRenderFreePicture(
-				widget->display,
-				menu->canvas[i].picture
-			);
-		}
-		if (menu->canvas[i].pixmap != None)
-			XFreePixmap(widget->display, menu->canvas[i].pixmap);
 		menu->canvas[i].pixmap = XCreatePixmap(
 			widget->display,
 			menu->window,
-			menu->geometry.width,
-			menu->geometry.height,
+			w, h,
 			widget->depth
 		);
 		menu->canvas[i].picture = XRenderCreatePicture(
@@ -1642,49 +2794,191 @@ drawmenu(Widget *widget, Menu *menu)
 			0,
 			NULL
 		);
-		XRenderFillRectangle(
+	}
+	menu->pixmapw = w;
+	menu->pixmaph = h;
+done:
+	menu->canvasw = menu->geometry.width;
+	menu->canvash = menu->geometry.height;
+	menu->redraw = true;
+}
+
+static void
+drawlabel(Widget *widget, Menu *menu, Item *item, XRectangle *rect)
+{
+	ctrlfnt_layout *layout;
+	XRectangle textrect;
+	Picture src;
+	size_t i;
+	int n, textx, textw, maxw, clipw, fitw;
+	bool batched;
+
+	/* labels wider than the menu could be made are ellipsized */
+	maxw = rect->width - rect->x - widget->shadowwid - PADDING;
+	if (menu->hassubmenu)
+		maxw -= TRIANGLE_WIDTH + TRIANGLE_PAD + PADDING;
+	textw = labelwidth(widget, item);
+	layout = item->layout;
+	clipw = rect->width;
+	if (textw > maxw) {
+		/* align by what is drawn of the label, up to its ellipsis */
+		textw = clipw = MAX(maxw, 1);
+		fitw = layout != NULL ? ctrlfnt_layout_fit(layout, clipw) : -1;
+		if (fitw >= 0)
+			textw = fitw;
+	}
+	if (widget->alignment == ALIGN_RIGHT && menu->hassubmenu)
+		textx = rect->width - textw - PADDING - TRIANGLE_WIDTH - TRIANGLE_PAD;
+	else if (widget->alignment == ALIGN_RIGHT)
+		textx = rect->width - textw - PADDING;
+	else if (widget->alignment == ALIGN_CENTER)
+		textx = rect->x + (menu->geometry.width - textw) / 2;
+	else
+		textx = rect->x;
+	/* labels without output are drawn engraved, in two passes */
+	for (n = 0; n < (item->output != NULL ? 1 : 2); n++) {
+		textrect = (XRectangle){
+			.x = textx + (item->output == NULL && n == 0),
+			.y = rect->y + (item->output == NULL && n == 0),
+			.width = clipw,
+			.height = rect->height,
+		};
+		batched = reservelabel(widget);
+		for (i = 0; i < CANVAS_FINAL; i++) {
+			if (item->output != NULL)
+				src = widget->colors[i][COLOR_FG].pict;
+			else if (n == 0)
+				src = widget->colors[SCHEME_SHADOW][COLOR_TOP].pict;
+			else
+				src = widget->colors[SCHEME_SHADOW][COLOR_BOT].pict;
+			if (!batched) {
+				ctrlfnt_draw(
+					widget->fontset,
+					menu->canvas[i].picture,
+					src,
+					textrect,
+					item->label,
+					item->labellen
+				);
+				continue;
+			}
+			widget->labels.texts[i][widget->labels.ntexts] =
+			(struct ctrlfnt_text){
+				.text = item->label,
+				.nbytes = item->labellen,
+				.layout = layout,
+				.rect = textrect,
+				.src = src,
+			};
+		}
+		if (batched)
+			widget->labels.ntexts++;
+	}
+}
+
+static int
+drawicon(Widget *widget, Menu *menu, Icon *icon, int y)
+{
+	size_t i;
+
+	if (uploadicon(widget, icon) == RETURN_FAILURE)
+		return RETURN_FAILURE;
+	for (i = 0; i < CANVAS_FINAL; i++) {
+		XRenderComposite(
 			widget->display,
-			PictOpClear,
+			PictOpOver,
+			widget->atlas.picture,
+			None,
 			menu->canvas[i].picture,
-			&(XRenderColor){ 0 },
+			icon->cell % ATLAS_COLUMNS * widget->atlas.cellsize,
+			icon->cell / ATLAS_COLUMNS * widget->atlas.cellsize,
 			0, 0,
-			menu->geometry.width,
-			menu->geometry.height
+			widget->shadowwid + PADDING
+			+ (widget->iconsize - icon->width) / 2,
+			y + (widget->itemh - icon->height) / 2,
+			icon->width,
+			icon->height
 		);
 	}
-	for (i = 0; i < CANVAS_FINAL; i++) for (j = 0; j < LAYER_LAST; j++) {
-		canvas[i][j].pixmap = XCreatePixmap(
-			widget->display,
-			menu->window,
-			menu->geometry.width,
-			menu->geometry.height,
-			widget->depth
-		);
-		canvas[i][j].picture = XRenderCreatePicture(
-			widget->display,
-			canvas[i][j].pixmap,
-			widget->xformat,
-			0,
-			NULL
-		);
+	return RETURN_SUCCESS;
+}
+
+static int
+drawitem(Widget *widget, Menu *menu, Item *item, int y)
+{
+	Icon *icon;
+	XRectangle rect;
+	size_t i;
+
+	rect.x = widget->shadowwid + PADDING;
+	if (menu->hasicon)
+		rect.x += widget->iconsize + PADDING;
+	rect.y = y;
+	rect.width = menu->geometry.width;
+	if (item->label == NULL) {
+		rect.height = widget->separatorh;
+		for (i = 0; i < CANVAS_FINAL; i++)
+			drawseparator(widget, menu->canvas[i].picture, &rect);
+		return rect.height;
+	}
+	rect.height = widget->itemh;
+	/* icons still being loaded are patched in by showicon() */
+	icon = geticon(widget, item->file, widget->iconsize);
+	if (icon != NULL && !icon->pending)
+		(void)drawicon(widget, menu, icon, rect.y);
+	if (openssubmenu(item)) {
+		for (i = 0; i < CANVAS_FINAL; i++) {
+			drawtriangle(
+				widget,
+				menu->canvas[i].picture,
+				widget->colors[i][COLOR_FG].pict,
+				rect.width - PADDING - TRIANGLE_WIDTH - TRIANGLE_PAD/2,
+				rect.y + widget->itemh/2 - TRIANGLE_HEIGHT/2,
+				DIR_RIGHT
+			);
+		}
+	}
+	drawlabel(widget, menu, item, &rect);
+	return rect.height;
+}
+
+static void
+drawmenu(Widget *widget, Menu *menu)
+{
+	Item *item;
+	size_t i;
+	int y;
+
+	/*
+	 * The NORMAL and SELECT canvases are retained between calls;
+	 * they are only rebuilt when the menu is resized or when
+	 * something marked its content as changed (scroll, theme).
+	 */
+	if (menu->canvasw != menu->geometry.width ||
+	    menu->canvash != menu->geometry.height)
+		alloccanvases(widget, menu);
+	if (!menu->redraw)
+		return;
+	menu->redraw = false;
+	if (widget->chrome.stale)
+		buildchrome(widget);
+	for (i = 0; i < CANVAS_FINAL; i++) {
 		XRenderFillRectangle(
 			widget->display,
 			PictOpClear,
-			canvas[i][j].picture,
+			menu->canvas[i].picture,
 			&(XRenderColor){ 0 },
 			0, 0,
 			menu->geometry.width,
 			menu->geometry.height
 		);
-	}
-	for (i = 0; i < CANVAS_FINAL; i++) {
-		drawshadows(widget, canvas[i][LAYER_BG].picture, &menu->geometry);
+		drawshadows(widget, menu->canvas[i].picture, &menu->geometry);
 		XRenderComposite(
 			widget->display,
 			PictOpSrc,
 			widget->colors[i][COLOR_BG].pict,
 			widget->opacity.pict,
-			canvas[i][LAYER_BG].picture,
+			menu->canvas[i].picture,
 			0, 0,
 			0, 0,
 			widget->shadowwid, widget->shadowwid,
@@ -1692,300 +2986,403 @@ drawmenu(Widget *widget, Menu *menu)
 			menu->geometry.height - widget->shadowwid * 2
 		);
 	}
-	rect.x = widget->shadowwid + PADDING;
-	if (menu->hasicon)
-		rect.x += widget->iconsize + PADDING;
-	rect.y = firstitempos(widget, menu);
-	rect.width = menu->geometry.width;
+	y = firstitempos(widget, menu);
 	for (item = menu->first; item != NULL; item = item->next) {
-		if (item->label == NULL) {
-			rect.height = widget->separatorh;
-			drawseparator(
-				widget,
-				canvas[CANVAS_NORMAL][LAYER_FG].picture,
-				&rect
-			);
-			drawseparator(
+		y += drawitem(widget, menu, item, y);
+		if (menu->overflow &&
+		    y + widget->itemh * 2 >=
+		    menu->geometry.height) {
+			break;
+		}
+	}
+	flushlabels(widget, menu);
+	y = widget->shadowwid;
+	if (cantearoff(widget, menu)) {
+		for (i = 0; i < CANVAS_FINAL; i++) {
+			drawdashline(
 				widget,
-				canvas[CANVAS_SELECT][LAYER_FG].picture,
-				&rect
+				menu->canvas[i].picture,
+				menu->geometry.width, y
 			);
-			goto next;
 		}
-		rect.height = widget->itemh;
-		image = loadicon(
+		y += widget->separatorh;
+	}
+	for (i = 0; menu->overflow && i < CANVAS_FINAL; i++) {
+		drawtriangle(
 			widget,
-			item->file,
-			widget->iconsize,
-			&iconw,
-			&iconh
+			menu->canvas[i].picture,
+			widget->colors[i][COLOR_FG].pict,
+			menu->geometry.width / 2 - TRIANGLE_HEIGHT / 2,
+			y + widget->separatorh /2 - TRIANGLE_WIDTH / 2,
+			DIR_UP
 		);
-		if (image != NULL) {
-			imlib_context_set_image(image);
-			imlib_context_set_drawable(
-				canvas[CANVAS_NORMAL][LAYER_FG].pixmap
-			);
-			imlib_render_image_on_drawable(
-				widget->shadowwid + PADDING
-				+ (widget->iconsize - iconw) / 2,
-				rect.y + (widget->itemh - iconh) / 2
-			);
-			imlib_context_set_drawable(
-				canvas[CANVAS_SELECT][LAYER_FG].pixmap
-			);
-			imlib_render_image_on_drawable(
-				widget->shadowwid + PADDING
-				+ (widget->iconsize - iconw) / 2,
-				rect.y + (widget->itemh - iconh) / 2
-			);
-			imlib_free_image();
-		}
-		if (openssubmenu(item)) {
-			drawtriangle(
-				widget,
-				canvas[CANVAS_NORMAL][LAYER_FG].picture,
-				widget->colors[SCHEME_NORMAL][COLOR_FG].pict,
-				rect.width - PADDING - TRIANGLE_WIDTH - TRIANGLE_PAD/2,
-				rect.y + widget->itemh/2 - TRIANGLE_HEIGHT/2,
-				DIR_RIGHT
-			);
-			drawtriangle(
-				widget,
-				canvas[CANVAS_SELECT][LAYER_FG].picture,
-				widget->colors[SCHEME_SELECT][COLOR_FG].pict,
-				rect.width - PADDING - TRIANGLE_WIDTH - TRIANGLE_PAD/2,
-				rect.y + widget->itemh/2 - TRIANGLE_HEIGHT/2,
-				DIR_RIGHT
-			);
-		}
-		textw = ctrlfnt_width(
-			widget->fontset,
-			item->label,
-			item->labellen
+		drawtriangle(
+			widget,
+			menu->canvas[i].picture,
+			widget->colors[i][COLOR_FG].pict,
+			menu->geometry.width / 2 - TRIANGLE_HEIGHT / 2,
+			menu->geometry.height - widget->separatorh /2
+			- TRIANGLE_WIDTH / 2,
+			DIR_DOWN
 		);
-		if (widget->alignment == ALIGN_RIGHT && menu->hassubmenu)
-			textx = rect.width - textw - PADDING - TRIANGLE_WIDTH - TRIANGLE_PAD;
-		else if (widget->alignment == ALIGN_RIGHT)
-			textx = rect.width - textw - PADDING;
-		else if (widget->alignment == ALIGN_CENTER)
-			textx = rect.x + (menu->geometry.width - textw) / 2;
-		else
-			textx = rect.x;
-		if (item->output != NULL) {
-			ctrlfnt_draw(
-				widget->fontset,
-				canvas[CANVAS_NORMAL][LAYER_FG].picture,
-				widget->colors[SCHEME_NORMAL][COLOR_FG].pict,
-				(XRectangle){
-					.x = textx,
-					.y = rect.y,
-					.width = rect.width,
-					.height = rect.height,
-				},
-				item->label,
-				item->labellen
-			);
-			ctrlfnt_draw(
-				widget->fontset,
-				canvas[CANVAS_SELECT][LAYER_FG].picture,
-				widget->colors[SCHEME_SELECT][COLOR_FG].pict,
-				(XRectangle){
-					.x = textx,
-					.y = rect.y,
-					.width = rect.width,
-					.height = rect.height,
-				},
-				item->label,
-				item->labellen
-			);
-		} else {
-			ctrlfnt_draw(
-				widget->fontset,
-				canvas[CANVAS_NORMAL][LAYER_FG].picture,
-				widget->colors[SCHEME_SHADOW][COLOR_TOP].pict,
-				(XRectangle){
-					.x = textx + 1,
-					.y = rect.y + 1,
-					.width = rect.width,
-					.height = rect.height,
-				},
-				item->label,
-				item->labellen
-			);
-			ctrlfnt_draw(
-				widget->fontset,
-				canvas[CANVAS_NORMAL][LAYER_FG].picture,
-				widget->colors[SCHEME_SHADOW][COLOR_BOT].pict,
-				(XRectangle){
-					.x = textx,
-					.y = rect.y,
-					.width = rect.width,
-					.height = rect.height,
-				},
-				item->label,
-				item->labellen
-			);
-			ctrlfnt_draw(
-				widget->fontset,
-				canvas[CANVAS_SELECT][LAYER_FG].picture,
-				widget->colors[SCHEME_SHADOW][COLOR_TOP].pict,
-				(XRectangle){
-					.x = textx + 1,
-					.y = rect.y + 1,
-					.width = rect.width,
-					.height = rect.height,
-				},
-				item->label,
-				item->labellen
-			);
-			ctrlfnt_draw(
-				widget->fontset,
-				canvas[CANVAS_SELECT][LAYER_FG].picture,
-				widget->colors[SCHEME_SHADOW][COLOR_BOT].pict,
-				(XRectangle){
-					.x = textx,
-					.y = rect.y,
-					.width = rect.width,
-					.height = rect.height,
-				},
-				item->label,
-				item->labellen
-			);
-		}
-next:
-		rect.y += rect.height;
+	}
+	XSetWindowBorderPixmap(widget->display, menu->window, widget->border.pix);
+	menu->recommit = true;
+}
+
+static int
+rowheight(Widget *widget, Item *item)
+{
+	return item->label == NULL ? widget->separatorh : widget->itemh;
+}
+
+static int
+rowsend(Widget *widget, Menu *menu, Item **last)
+{
+	Item *item;
+	int y;
+
+	/* where drawmenu() stops drawing rows, and the last row it draws */
+	*last = NULL;
+	y = firstitempos(widget, menu);
+	for (item = menu->first; item != NULL; item = item->next) {
+		y += rowheight(widget, item);
+		*last = item;
 		if (menu->overflow &&
-		    rect.y + widget->itemh * 2 >=
+		    y + widget->itemh * 2 >=
 		    menu->geometry.height) {
 			break;
 		}
 	}
+	return y;
+}
+
+static void
+clearrows(Widget *widget, Menu *menu, int y, int height)
+{
+	size_t i;
+
+	if (height <= 0)
+		return;
 	for (i = 0; i < CANVAS_FINAL; i++) {
-		y = widget->shadowwid;
-		if (cantearoff(widget, menu)) {
-			drawdashline(
-				widget,
-				canvas[CANVAS_NORMAL][LAYER_FG].picture,
-				menu->geometry.width, y
-			);
-			drawdashline(
-				widget,
-				canvas[CANVAS_SELECT][LAYER_FG].picture,
-				menu->geometry.width, y
-			);
-			y += widget->separatorh;
-		}
-		if (menu->overflow) {
-			drawtriangle(
-				widget,
-				canvas[i][LAYER_FG].picture,
-				widget->colors[i][COLOR_FG].pict,
-				menu->geometry.width / 2 - TRIANGLE_HEIGHT / 2,
-				y + widget->separatorh /2 - TRIANGLE_WIDTH / 2,
-				DIR_UP
-			);
-			drawtriangle(
-				widget,
-				canvas[i][LAYER_FG].picture,
-				widget->colors[i][COLOR_FG].pict,
-				menu->geometry.width / 2 - TRIANGLE_HEIGHT / 2,
-				menu->geometry.height - widget->separatorh /2
-				- TRIANGLE_WIDTH / 2,
-				DIR_DOWN
-			);
-		}
 		XRenderComposite(
 			widget->display,
-			PictOpOver,
-			canvas[i][LAYER_FG].picture,
-			None,
-			canvas[i][LAYER_BG].picture,
-			0, 0,
+			PictOpSrc,
+			widget->colors[i][COLOR_BG].pict,
+			widget->opacity.pict,
+			menu->canvas[i].picture,
 			0, 0,
 			0, 0,
-			menu->geometry.width,
-			menu->geometry.height
+			widget->shadowwid, y,
+			menu->geometry.width - widget->shadowwid * 2,
+			height
 		);
-		XRenderComposite(
+	}
+}
+
+static void
+copyrows(Widget *widget, Menu *menu, int srcy, int dsty, int height)
+{
+	size_t i;
+
+	if (height <= 0)
+		return;
+	for (i = 0; i < CANVAS_FINAL; i++) {
+		XCopyArea(
 			widget->display,
-			PictOpOver,
-			canvas[i][LAYER_BG].picture,
-			None,
-			menu->canvas[i].picture,
-			0, 0,
-			0, 0,
-			0, 0,
-			menu->geometry.width,
-			menu->geometry.height
+			menu->canvas[i].pixmap,
+			menu->canvas[i].pixmap,
+			widget->gc,
+			0, srcy,
+			menu->geometry.width, height,
+			0, dsty
+		);
+	}
+}
+
+static bool
+scrollcanvases(Widget *widget, Menu *menu, bool down)
+{
+	Item *item, *oldlast, *newlast;
+	int y0, oldend, newend, height, y;
+
+	/*
+	 * Shift the rows still visible by the height of the row that
+	 * scrolled out and draw just the row (or rows) that scrolled in,
+	 * instead of redrawing the whole menu.
+	 */
+	if (menu->redraw ||
+	    menu->canvasw != menu->geometry.width ||
+	    menu->canvash != menu->geometry.height)
+		return false;
+	if (widget->gc == NULL) {
+		widget->gc = XCreateGC(
+			widget->display,
+			menu->canvas[CANVAS_NORMAL].pixmap,
+			GCGraphicsExposures,
+			&(XGCValues){ .graphics_exposures = False }
+		);
+		if (widget->gc == NULL)
+			return false;
+	}
+	y0 = firstitempos(widget, menu);
+	oldend = rowsend(widget, menu, &oldlast);
+	if (down) {
+		if (menu->last->next == NULL)
+			return true;
+		height = rowheight(widget, menu->first);
+		menu->first = menu->first->next;
+		menu->last = menu->last->next;
+		newend = rowsend(widget, menu, &newlast);
+		copyrows(widget, menu, y0 + height, y0, oldend - y0 - height);
+		clearrows(
+			widget, menu,
+			oldend - height,
+			MAX(oldend, newend) - (oldend - height)
+		);
+		y = oldend - height;
+		item = newlast != oldlast ? oldlast->next : NULL;
+		for (; item != NULL; item = item->next) {
+			y += drawitem(widget, menu, item, y);
+			if (item == newlast)
+				break;
+		}
+	} else {
+		if (menu->first->prev == NULL)
+			return true;
+		menu->first = menu->first->prev;
+		menu->last = menu->last->prev;
+		height = rowheight(widget, menu->first);
+		newend = rowsend(widget, menu, &newlast);
+		copyrows(widget, menu, y0, y0 + height, newend - y0 - height);
+		clearrows(widget, menu, y0, height);
+		clearrows(widget, menu, newend, oldend - newend);
+		(void)drawitem(widget, menu, menu->first, y0);
+	}
+	flushlabels(widget, menu);
+	menu->recommit = true;
+	return true;
+}
+
+static void
+paintrow(Widget *widget, Menu *menu, int canvas, int op, int y, int height)
+{
+	XRenderComposite(
+		widget->display,
+		op,
+		menu->canvas[canvas].picture,
+		None,
+		menu->canvas[CANVAS_FINAL].picture,
+		0, y,
+		0, 0,
+		0, y,
+		menu->geometry.width,
+		height
+	);
+}
+
+static void
+commitdraw(Widget *widget, Menu *menu, int ypos)
+{
+	int height;
+
+	if (menu->selected == NULL || ypos < 0) {
+		ypos = -1;
+		height = 0;
+	} else if (menu->selected == &tearoff || menu->selected == &scrollup ||
+	    menu->selected == &scrolldown) {
+		height = widget->separatorh;
+	} else {
+		height = widget->itemh;
+	}
+	if (menu->selected != NULL)
+		menu->selposition = ypos;
+	if (menu->recommit) {
+		menu->recommit = false;
+		paintrow(
+			widget, menu, CANVAS_NORMAL, PictOpSrc,
+			0, menu->geometry.height
+		);
+		if (ypos >= 0) {
+			paintrow(
+				widget, menu, CANVAS_SELECT, PictOpOver,
+				ypos, height
+			);
+		}
+		XSetWindowBackgroundPixmap(
+			widget->display,
+			menu->window,
+			menu->canvas[CANVAS_FINAL].pixmap
+		);
+		XClearWindow(widget->display, menu->window);
+		goto done;
+	}
+
+	/*
+	 * The final canvas is already up to date but for the highlight;
+	 * restore the previously highlighted row from the NORMAL canvas,
+	 * highlight the new one, and expose only those two rectangles.
+	 */
+	if (ypos == menu->drawnposition && height == menu->drawnheight)
+		return;
+	if (menu->drawnposition >= 0) {
+		paintrow(
+			widget, menu, CANVAS_NORMAL, PictOpSrc,
+			menu->drawnposition, menu->drawnheight
+		);
+	}
+	if (ypos >= 0) {
+		paintrow(
+			widget, menu, CANVAS_SELECT, PictOpOver,
+			ypos, height
+		);
+	}
+	if (menu->drawnposition >= 0) {
+		XClearArea(
+			widget->display, menu->window,
+			0, menu->drawnposition,
+			menu->geometry.width, menu->drawnheight,
+			False
+		);
+	}
+	if (ypos >= 0) {
+		XClearArea(
+			widget->display, menu->window,
+			0, ypos,
+			menu->geometry.width, height,
+			False
+		);
+	}
+done:
+	menu->drawnposition = ypos;
+	menu->drawnheight = height;
+}
+
+static void
+schedulepaint(Widget *widget, Menu *menu, int ypos)
+{
+	/*
+	 * Event handlers only record what the menu should look like;
+	 * the loop paints it once all pending events have been read,
+	 * so a burst of motion events costs a single repaint.
+	 */
+	if (menu->selected == NULL || ypos < 0)
+		ypos = -1;
+	if (menu->selected != NULL)
+		menu->selposition = ypos;
+	menu->paintposition = ypos;
+	menu->dirty = true;
+	widget->dirty = true;
+}
+
+static void
+paintmenu(Widget *widget, Menu *menu)
+{
+	if (!menu->dirty)
+		return;
+	menu->dirty = false;
+	drawmenu(widget, menu);
+	commitdraw(widget, menu, menu->paintposition);
+}
+
+static void
+paintmenus(Widget *widget)
+{
+	Menu *menu;
+
+	for (menu = widget->menus; menu != NULL; menu = menu->next)
+		paintmenu(widget, menu);
+	widget->dirty = false;
+	setdeadline(&widget->nextframe, FRAME_TIME);
+}
+
+static int
+painttimeout(Widget *widget)
+{
+	if (!widget->dirty)
+		return -1;
+	return mstodeadline(&widget->nextframe);
+}
+
+static void
+refreshrow(Widget *widget, Menu *menu, int y, int height)
+{
+	if (menu->recommit)
+		return;         /* the whole final canvas will be rebuilt */
+	if (widget->scrolling.menu == menu && widget->scrolling.height > 0)
+		return;         /* the rows are composed anew as they scroll */
+	paintrow(widget, menu, CANVAS_NORMAL, PictOpSrc, y, height);
+	if (y == menu->drawnposition) {
+		paintrow(
+			widget, menu, CANVAS_SELECT, PictOpOver,
+			y, menu->drawnheight
 		);
 	}
-	XSetWindowBackgroundPixmap(
-		widget->display,
-		menu->window,
-		menu->canvas[LAYER_BG].pixmap
+	XClearArea(
+		widget->display, menu->window,
+		0, y,
+		menu->geometry.width, height,
+		False
 	);
-	XSetWindowBorderPixmap(widget->display, menu->window, widget->border.pix);
-	XClearWindow(widget->display, menu->window);
-	for (i = 0; i < CANVAS_FINAL; i++) for (j = 0; j < LAYER_LAST; j++) {
-		XRenderFreePicture(widget->display, canvas[i][j].picture);
-		XFreePixmap(widget->display, canvas[i][j].pixmap);
-	}
 }
 
 static void
-commitdraw(Widget *widget, Menu *menu, int ypos)
+showicon(Widget *widget, Icon *icon)
 {
-	int height;
+	Menu *menu;
+	Item *item;
+	int y;
 
-	if (menu->selected == NULL)
+	if (icon->pixels == NULL || icon->size != widget->iconsize)
 		return;
-	if (menu->selected == &tearoff || menu->selected == &scrollup ||
-	    menu->selected == &scrolldown)
-		height = widget->separatorh;
-	else
-		height = widget->itemh;
-	menu->selposition = ypos;
-	XRenderFillRectangle(
-		widget->display,
-		PictOpClear,
-		menu->canvas[CANVAS_FINAL].picture,
-		&(XRenderColor){ 0 },
-		0, 0,
-		menu->geometry.width,
-		menu->geometry.height
-	);
-	XRenderComposite(
-		widget->display,
-		PictOpOver,
-		menu->canvas[CANVAS_NORMAL].picture,
-		None,
-		menu->canvas[CANVAS_FINAL].picture,
-		0, 0,
-		0, 0,
-		0, 0,
-		menu->geometry.width,
-		menu->geometry.height
-	);
-	if (ypos >= 0) {
-		XRenderComposite(
-			widget->display,
-			PictOpOver,
-			menu->canvas[CANVAS_SELECT].picture,
-			None,
-			menu->canvas[CANVAS_FINAL].picture,
-			0, ypos,
-			0, 0,
-			0, ypos,
-			menu->geometry.width,
-			height
-		);
+	for (menu = widget->menus; menu != NULL; menu = menu->next) {
+		if (menu->redraw ||
+		    menu->canvasw != menu->geometry.width ||
+		    menu->canvash != menu->geometry.height)
+			continue;       /* it will be drawn in full anyway */
+		y = firstitempos(widget, menu);
+		for (item = menu->first; item != NULL; item = item->next) {
+			if (item->label == NULL) {
+				y += widget->separatorh;
+				continue;
+			}
+			if (item->file != NULL &&
+			    strcmp(item->file, icon->file) == 0 &&
+			    drawicon(widget, menu, icon, y) == RETURN_SUCCESS)
+				refreshrow(widget, menu, y, widget->itemh);
+			y += widget->itemh;
+			if (menu->overflow &&
+			    y + widget->itemh * 2 >=
+			    menu->geometry.height) {
+				break;
+			}
+		}
 	}
-	XSetWindowBackgroundPixmap(
-		widget->display,
-		menu->window,
-		menu->canvas[CANVAS_FINAL].pixmap
-	);
-	XClearWindow(widget->display, menu->window);
+}
+
+static void
+loadedicons(Widget *widget)
+{
+	struct Loader *loader = &widget->loader;
+	Icon *icon, *next;
+	char buf[64];
+
+	while (read(loader->pipefd[0], buf, sizeof(buf)) > 0)
+		;
+	(void)pthread_mutex_lock(&loader->mutex);
+	icon = loader->done;
+	loader->done = NULL;
+	(void)pthread_mutex_unlock(&loader->mutex);
+	for (; icon != NULL; icon = next) {
+		next = icon->qnext;
+		icon->pending = false;
+		if (icon->pixels != NULL) {
+			icon->nbytes += (size_t)icon->width * icon->height * 4;
+			widget->icons.nbytes += (size_t)icon->width * icon->height * 4;
+		}
+		showicon(widget, icon);
+	}
+	evicticons(widget, NULL);
 }
 
 static bool
@@ -2005,11 +3402,11 @@ selitem(Widget *widget, Menu *menu, Item *from, Item *first, Item *last, int ypo
 			if (menu->first != first) {
 				menu->first = first;
 				menu->last = last;
+				menu->redraw = true;
 			}
 			if (dir != SEL_LAST) {
 				menu->selected = item;
-				drawmenu(widget, menu);
-				commitdraw(widget, menu, ypos);
+				schedulepaint(widget, menu, ypos);
 				return true;
 			}
 		}
@@ -2028,12 +3425,10 @@ selitem(Widget *widget, Menu *menu, Item *from, Item *first, Item *last, int ypo
 	}
 	if (dir == SEL_LAST && prev != NULL) {
 		menu->selected = prev;
-		drawmenu(widget, menu);
-		commitdraw(widget, menu, prevypos);
+		schedulepaint(widget, menu, prevypos);
 		return true;
 	} else {
-		drawmenu(widget, menu);
-		commitdraw(widget, menu, -1);
+		schedulepaint(widget, menu, -1);
 		return false;
 	}
 }
@@ -2050,6 +3445,41 @@ selfirst(Widget *widget, Menu *menu)
 	);
 }
 
+static Window
+takewindow(Widget *widget, Menu *menu, long eventmask, bool override)
+{
+	struct Pool *pool = &widget->pool;
+	struct Pooled *pooled;
+	Window window;
+	size_t i;
+	int w, h;
+
+	if (!override || pool->nentries == 0)
+		return createwindow(widget, &menu->geometry, eventmask, override);
+
+	/* prefer a window whose canvases fit; else any, for the window */
+	w = ROUNDUP(menu->geometry.width, CANVAS_BUCKET);
+	h = ROUNDUP(menu->geometry.height, CANVAS_BUCKET);
+	for (i = pool->nentries - 1; i > 0; i--)
+		if (pool->entries[i].pixmapw == w && pool->entries[i].pixmaph == h)
+			break;
+	pooled = &pool->entries[i];
+	memcpy(menu->canvas, pooled->canvas, sizeof(menu->canvas));
+	menu->pixmapw = pooled->pixmapw;
+	menu->pixmaph = pooled->pixmaph;
+	window = pooled->window;
+	*pooled = pool->entries[--pool->nentries];
+	XMoveResizeWindow(
+		widget->display,
+		window,
+		menu->geometry.x,
+		menu->geometry.y,
+		menu->geometry.width,
+		menu->geometry.height
+	);
+	return window;
+}
+
 static void
 popupmenu(Widget *widget, Item *items, XRectangle *basis, bool isroot)
 {
@@ -2112,11 +3542,7 @@ popupmenu(Widget *widget, Item *items, XRectangle *basis, bool isroot)
 		nitems++;
 		if (item->label != NULL) {
 			menuh += widget->itemh;
-			textw = ctrlfnt_width(
-				widget->fontset,
-				item->label,
-				item->labellen
-			);
+			textw = labelwidth(widget, item);
 		} else {
 			textw = 0;
 			menuh += widget->separatorh;
@@ -2202,10 +3628,10 @@ popupmenu(Widget *widget, Item *items, XRectangle *basis, bool isroot)
 		}
 	}
 
-	menu->window = createwindow(
-		widget, &menu->geometry,
-		KeyPressMask | StructureNotifyMask | LeaveWindowMask |
-		ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
+	menu->recyclable = override_redirect;
+	menu->window = takewindow(
+		widget, menu,
+		MENU_EVENTS,
 		override_redirect
 	);
 	if (!options.rootmode && options.client != None) {
@@ -2261,30 +3687,81 @@ popupmenu(Widget *widget, Item *items, XRectangle *basis, bool isroot)
 	);
 
 	widget->menus = menu;
-	drawmenu(widget, menu);
 	if (caller != NULL)
 		selfirst(widget, menu);
 	else
-		commitdraw(widget, menu, -1);
+		schedulepaint(widget, menu, -1);
+
+	/* a menu is never mapped before it has been painted */
+	paintmenu(widget, menu);
 	XMapRaised(widget->display, menu->window);
 }
 
+static void
+stopscroll(Widget *widget)
+{
+	struct Scroll *scrolling = &widget->scrolling;
+
+	/* the canvases are already past the row left half scrolled */
+	if (scrolling->menu != NULL && scrolling->height > 0)
+		scrolling->menu->recommit = true;
+	scrolling->menu = NULL;
+	scrolling->height = 0;
+}
+
+static void
+stophover(Widget *widget, bool revert)
+{
+	struct Hover *hover = &widget->hover;
+
+	if (hover->menu == NULL)
+		return;
+	if (revert) {
+		/* the pending item was only crossed on the way */
+		hover->menu->selected = hover->restore;
+		schedulepaint(widget, hover->menu, hover->restorepos);
+	}
+	hover->menu = NULL;
+}
+
 static void
 delmenu(Widget *widget)
 {
 	Menu *menu;
-	size_t i;
+	struct Pooled *pooled;
+	XEvent xev;
 
 	if ((menu = widget->menus) == NULL)
 		return;
+	if (widget->scrolling.menu == menu)
+		stopscroll(widget);
+	if (widget->hover.menu == menu)
+		stophover(widget, false);
 	if (menu->directory)
 		cleanitems(menu->items, NULL);
 	widget->menus = menu->next;
-	XDestroyWindow(widget->display, menu->window);
-	for (i = 0; i < CANVAS_LAST; i++) {
-		XRenderFreePicture(widget->display, menu->canvas[i].picture);
-		XFreePixmap(widget->display, menu->canvas[i].pixmap);
+	if (menu->recyclable && widget->pool.nentries < POOL_SIZE) {
+		XUnmapWindow(widget->display, menu->window);
+
+		/* events still on their way to the old menu must not reach the new */
+		(void)XSync(widget->display, False);
+		while (XCheckWindowEvent(widget->display, menu->window,
+		                         MENU_EVENTS, &xev))
+			;
+		while (XCheckTypedWindowEvent(widget->display, menu->window,
+		                              ClientMessage, &xev))
+			;
+		pooled = &widget->pool.entries[widget->pool.nentries++];
+		*pooled = (struct Pooled){
+			.window = menu->window,
+			.pixmapw = menu->pixmapw,
+			.pixmaph = menu->pixmaph,
+		};
+		memcpy(pooled->canvas, menu->canvas, sizeof(pooled->canvas));
+		return;
 	}
+	XDestroyWindow(widget->display, menu->window);
+	freecanvases(widget, menu->canvas);
 }
 
 static void
@@ -2365,65 +3842,187 @@ done:
 }
 
 static void
-scroll(Widget *widget, bool down)
+startscroll(Widget *widget, Menu *menu, bool down)
 {
-	XRectangle rect;
+	struct Scroll *scrolling = &widget->scrolling;
+
+	if (menu != widget->menus)
+		return;
+	if (scrolling->menu == menu && scrolling->down == down)
+		return;         /* already scrolling that way */
+	stopscroll(widget);
+	setdeadline(&scrolling->next, FRAME_TIME);
+	scrolling->menu = menu;
+	scrolling->down = down;
+	scrolling->nrows = 0;
+}
+
+static int
+scrolltimeout(Widget *widget)
+{
+	if (widget->scrolling.menu == NULL)
+		return -1;
+	return mstodeadline(&widget->scrolling.next);
+}
+
+static void
+shiftfinal(Widget *widget, Menu *menu, int step)
+{
+	struct Scroll *scrolling = &widget->scrolling;
+	int y0, y1, h, p;
+
+	/*
+	 * The NORMAL canvas already shows the rows as they will be once
+	 * the row scrolling by is gone; the final canvas shows them
+	 * offset by the pixels still to go.  Each frame, shift what is
+	 * left of the row going out and compose the rest from NORMAL.
+	 */
+	y0 = firstitempos(widget, menu);
+	y1 = menu->geometry.height - widget->separatorh - widget->shadowwid;
+	h = scrolling->height;
+	p = scrolling->offset;
+	if (scrolling->down) {
+		if (h > p) {
+			XCopyArea(
+				widget->display,
+				menu->canvas[CANVAS_FINAL].pixmap,
+				menu->canvas[CANVAS_FINAL].pixmap,
+				widget->gc,
+				0, y0 + step,
+				menu->geometry.width, h - p,
+				0, y0
+			);
+		}
+		XRenderComposite(
+			widget->display,
+			PictOpSrc,
+			menu->canvas[CANVAS_NORMAL].picture,
+			None,
+			menu->canvas[CANVAS_FINAL].picture,
+			0, y0,
+			0, 0,
+			0, y0 + h - p,
+			menu->geometry.width,
+			y1 - (y0 + h - p)
+		);
+	} else {
+		if (y1 - y0 > p) {
+			XCopyArea(
+				widget->display,
+				menu->canvas[CANVAS_FINAL].pixmap,
+				menu->canvas[CANVAS_FINAL].pixmap,
+				widget->gc,
+				0, y0 + p - step,
+				menu->geometry.width, y1 - y0 - p,
+				0, y0 + p
+			);
+		}
+		XRenderComposite(
+			widget->display,
+			PictOpSrc,
+			menu->canvas[CANVAS_NORMAL].picture,
+			None,
+			menu->canvas[CANVAS_FINAL].picture,
+			0, y0 + h - p,
+			0, 0,
+			0, y0,
+			menu->geometry.width,
+			p
+		);
+	}
+	if (p == h) {
+		/* the row is through; settle on the canvas as it is */
+		paintrow(widget, menu, CANVAS_NORMAL, PictOpSrc, y0, y1 - y0);
+	}
+	XClearArea(
+		widget->display, menu->window,
+		0, y0,
+		menu->geometry.width, y1 - y0,
+		False
+	);
+}
+
+static bool
+scrollrows(Widget *widget, Menu *menu, bool down, int nrows)
+{
+	bool shift;
+
+	/* shifting the canvases pays off only for a few rows */
+	shift = nrows <= SCROLL_MAXROWS;
+	for (; nrows > 0; nrows--) {
+		if (down ? menu->last->next == NULL : menu->first->prev == NULL)
+			break;
+		if (shift && scrollcanvases(widget, menu, down))
+			continue;
+		if (down) {
+			menu->first = menu->first->next;
+			menu->last = menu->last->next;
+		} else {
+			menu->first = menu->first->prev;
+			menu->last = menu->last->prev;
+		}
+		menu->redraw = true;
+	}
+	return nrows == 0;
+}
+
+static void
+scroll(Widget *widget)
+{
+	struct Scroll *scrolling = &widget->scrolling;
 	Menu *menu;
-	time_t elapsed;
-	struct timespec ts;
-	int ret;
-	struct pollfd pfd = {
-		.fd = widget->fd,
-		.events = POLLIN,
-	};
+	Item *item;
+	int pixels, step, y;
+	bool animate;
 
-	if ((menu = widget->menus) == NULL)
+	if ((menu = scrolling->menu) == NULL)
 		return;
-	if (down)
-		rect.y = menu->geometry.height - widget->separatorh - widget->shadowwid;
+	if (scrolling->down)
+		y = menu->geometry.height - widget->separatorh - widget->shadowwid;
 	else
-		rect.y = widget->shadowwid + widget->separatorh;
-	rect.x = 0;
-	rect.width = menu->geometry.width;
-	rect.height = widget->separatorh;
-	for (;;) {
-		static int const SCROLL_TIME = 32;
-		if (XPending(widget->display) > 0)
-			break;
-		switch ((ret = poll(&pfd, 1, SCROLL_TIME))) {
-		case -1:
-			if (errno == EINTR)
-				continue;
-			return;
-		default:
-			egettime(&ts);
-			elapsed = (ts.tv_sec - widget->lasttime.tv_sec) * 1000;
-			elapsed += ts.tv_nsec / 1000000;
-			elapsed -= widget->lasttime.tv_nsec / 1000000;
-			if (elapsed < SCROLL_TIME)
-				return;
-			/* fallthrough */
-		case 0:
-			if (down) {
-				if (menu->last->next == NULL)
-					break;
-				menu->first = menu->first->next;
-				menu->last = menu->last->next;
-			} else {
-				if (menu->first->prev == NULL)
-					break;
-				menu->first = menu->first->prev;
-				menu->last = menu->last->prev;
+		y = widget->shadowwid + widget->separatorh;
+	if (menu->redraw || menu->recommit)
+		scrolling->height = 0;  /* the canvases change under the row */
+	paintmenu(widget, menu);        /* shift what is shown, highlight too */
+
+	/*
+	 * Rows scroll by a few pixels each frame, a row each SCROLL_TIME;
+	 * the longer the arrow is hovered, the faster they go.
+	 */
+	pixels = MIN(1 + scrolling->nrows / SCROLL_ACCEL, SCROLL_MAXROWS);
+	pixels = MAX(1, pixels * widget->itemh * FRAME_TIME / SCROLL_TIME);
+	for (; pixels > 0; pixels -= step) {
+		if (scrolling->height > 0) {
+			step = MIN(pixels, scrolling->height - scrolling->offset);
+			scrolling->offset += step;
+			shiftfinal(widget, menu, step);
+			if (scrolling->offset == scrolling->height) {
+				scrolling->height = 0;
+				scrolling->nrows++;
 			}
-			drawmenu(widget, menu);
-			commitdraw(widget, menu, rect.y);
-			XFlush(widget->display);
-			if (ret == 0)
-				break;
-			egettime(&widget->lasttime);
+			continue;
+		}
+		item = scrolling->down ? menu->last->next : menu->first->prev;
+		if (item == NULL) {
+			stopscroll(widget);
 			break;
 		}
+		step = rowheight(widget, scrolling->down ? menu->first : item);
+
+		/* only a final canvas that is up to date can be shifted */
+		animate = !menu->recommit;
+		if (scrollrows(widget, menu, scrolling->down, 1) && animate &&
+		    !menu->redraw) {
+			menu->recommit = false;
+			scrolling->height = step;
+			scrolling->offset = 0;
+			step = 0;
+		} else {
+			scrolling->nrows++;
+		}
 	}
+	schedulepaint(widget, menu, y);
+	setdeadline(&scrolling->next, FRAME_TIME);
 }
 
 static void
@@ -2432,12 +4031,15 @@ forkandtearoff(Widget *widget, Menu *menu)
 	if (efork() == 0) {
 		/* child */
 		ctrlfnt_free(widget->fontset);
+		stoploader(widget, false);      /* the thread is not forked */
+		cleanicons(widget);
 		while (close(widget->fd) == -1) {
 			if (errno == EINTR)
 				continue;
 			err(EXIT_FAILURE, "close");
 		}
-		*widget = (Widget){ 0 };
+		/* keep the generation, the items' layouts use the old font */
+		*widget = (Widget){ .fontgen = widget->fontgen };
 		widget->display = NULL;
 		options.items = menu->first,
 		options.monitor = -1,
@@ -2569,6 +4171,70 @@ getmenu(Widget *widget, Window window)
 	return NULL;
 }
 
+static long
+edgeside(long x, long y, long ax, long ay, long bx, long by)
+{
+	return (x - bx) * (ay - by) - (ax - bx) * (y - by);
+}
+
+static bool
+aimsatsubmenu(Widget *widget, Menu *menu, int x, int y)
+{
+	Menu *submenu;
+	long ax, ay, bx, by, cx, cy, d1, d2, d3;
+
+	for (submenu = widget->menus; submenu != NULL; submenu = submenu->next)
+		if (submenu->next == menu)
+			break;
+	if (submenu == NULL)
+		return false;   /* no submenu open from this menu */
+	if (x == widget->hover.x && y == widget->hover.y)
+		return false;
+
+	/*
+	 * The pointer heads for the submenu if it lies within the
+	 * triangle spanned by its previous position and the edge of
+	 * the submenu facing this menu.
+	 */
+	ax = widget->hover.x;
+	ay = widget->hover.y;
+	bx = cx = submenu->geometry.x;
+	if (submenu->geometry.x < menu->geometry.x)
+		bx = cx = submenu->geometry.x + submenu->geometry.width;
+	by = submenu->geometry.y;
+	cy = submenu->geometry.y + submenu->geometry.height;
+	d1 = edgeside(x, y, ax, ay, bx, by);
+	d2 = edgeside(x, y, bx, by, cx, cy);
+	d3 = edgeside(x, y, cx, cy, ax, ay);
+	return !((d1 < 0 || d2 < 0 || d3 < 0) && (d1 > 0 || d2 > 0 || d3 > 0));
+}
+
+static int
+hovertimeout(Widget *widget)
+{
+	if (widget->hover.menu == NULL)
+		return -1;
+	return mstodeadline(&widget->hover.settle);
+}
+
+static void
+settlehover(Widget *widget)
+{
+	struct Hover *hover = &widget->hover;
+	Menu *menu;
+
+	if ((menu = hover->menu) == NULL)
+		return;
+	hover->menu = NULL;
+	if (hover->item == NULL)
+		return;
+	while (widget->menus != menu)
+		delmenu(widget);
+	if (openssubmenu(hover->item)) {
+		openitem(widget, hover->item, hover->ypos, false);
+	}
+}
+
 static void
 xbuttonrelease(Widget *widget, XEvent *xev)
 {
@@ -2583,6 +4249,7 @@ xbuttonrelease(Widget *widget, XEvent *xev)
 	    xevent->button != Button3)
 		return;
 	alt = (xevent->button == Button2);
+	settlehover(widget);
 	menu = getmenu(widget, xevent->window);
 	if (menu == NULL)
 		return;
@@ -2600,6 +4267,56 @@ xbuttonrelease(Widget *widget, XEvent *xev)
 	}
 }
 
+static bool
+iswheelevent(XEvent *xev, Window window)
+{
+	if (xev->type != ButtonPress && xev->type != ButtonRelease)
+		return false;
+	if (xev->xbutton.window != window)
+		return false;
+	return xev->xbutton.button == Button4 || xev->xbutton.button == Button5;
+}
+
+static void
+xwheel(Widget *widget, XButtonEvent *xevent)
+{
+	XEvent ev;
+	Menu *menu;
+	Item *item;
+	int nrows, ypos;
+
+	menu = getmenu(widget, xevent->window);
+	if (menu == NULL || !menu->overflow)
+		return;
+
+	/*
+	 * Fold the notches queued right after this one into a single
+	 * scroll; stop at any other event, so that keys and motion are
+	 * still handled in the order they came in.
+	 */
+	nrows = xevent->button == Button5 ? 1 : -1;
+	while (XPending(widget->display) > 0) {
+		(void)XPeekEvent(widget->display, &ev);
+		if (!iswheelevent(&ev, xevent->window))
+			break;
+		(void)XNextEvent(widget->display, &ev);
+		if (ev.type == ButtonPress)
+			nrows += ev.xbutton.button == Button5 ? 1 : -1;
+	}
+	if (nrows == 0)
+		return;
+	while (widget->menus != menu)
+		delmenu(widget);
+	if (widget->scrolling.menu == menu)
+		stopscroll(widget);
+	(void)scrollrows(widget, menu, nrows > 0, abs(nrows));
+	item = getitem(widget, menu, xevent->y, &ypos);
+	if (item == &scrollup || item == &scrolldown)
+		startscroll(widget, menu, item == &scrolldown);
+	menu->selected = item;
+	schedulepaint(widget, menu, ypos);
+}
+
 static void
 xbuttonpress(Widget *widget, XEvent *xev)
 {
@@ -2609,6 +4326,11 @@ xbuttonpress(Widget *widget, XEvent *xev)
 	int ypos;
 
 	xevent = (XButtonEvent *)xev;
+	stophover(widget, true);
+	if (xevent->button == Button4 || xevent->button == Button5) {
+		xwheel(widget, xevent);
+		return;
+	}
 	menu = getmenu(widget, xevent->window);
 	if (menu == NULL) {
 		closepopups(widget);
@@ -2644,10 +4366,7 @@ xconfigurenotify(Widget *widget, XEvent *xev)
 	menu->geometry.height = xevent->height;
 	if (width == menu->geometry.width && height == menu->geometry.height)
 		return;
-	drawmenu(widget, menu);
-	if (menu->selected != NULL) {
-		commitdraw(widget, menu, menu->selposition);
-	}
+	schedulepaint(widget, menu, menu->selposition);
 }
 
 static void
@@ -2683,6 +4402,7 @@ xkeypress(Widget *widget, XEvent *xev)
 
 	if ((menu = widget->menus) == NULL)
 		return;
+	stophover(widget, true);
 	xevent = (XKeyEvent *)xev;
 	ksym = XkbKeycodeToKeysym(widget->display, xevent->keycode, 0, 0);
 	if (ksym == XK_Tab && FLAG(xevent->state, ShiftMask))
@@ -2752,36 +4472,70 @@ xleave(Widget *widget, XEvent *xev)
 	if (menu != widget->menus)
 		return;
 	menu->selected = NULL;
-	commitdraw(widget, menu, -1);
+	if (widget->scrolling.menu == menu)
+		stopscroll(widget);
+	if (widget->hover.menu == menu)
+		stophover(widget, false);
+	schedulepaint(widget, menu, -1);
 }
 
 static void
 xmotion(Widget *widget, XEvent *xev)
 {
 	XMotionEvent *xevent;
+	struct Hover *hover = &widget->hover;
 	Menu *menu;
-	Item *item;
-	int ypos;
+	Item *item, *prev;
+	int ypos, prevpos;
+	bool aiming;
 
 	xevent = (XMotionEvent *)xev;
 	menu = getmenu(widget, xevent->window);
 	if (menu == NULL)
 		return;
+	aiming = aimsatsubmenu(widget, menu, xevent->x_root, xevent->y_root);
+	hover->x = xevent->x_root;
+	hover->y = xevent->y_root;
+
+	/* the pointer left the menu of the pending item before it settled */
+	if (hover->menu != NULL && hover->menu != menu)
+		stophover(widget, true);
+
 	item = getitem(widget, menu, xevent->y, &ypos);
 	if (item == &scrollup || item == &scrolldown)
-		scroll(widget, item == &scrolldown);
+		startscroll(widget, menu, item == &scrolldown);
+	else if (widget->scrolling.menu == menu)
+		stopscroll(widget);
 	if (item == menu->selected)
 		return;
 	if (item == NULL)
 		ypos = -1;
+	prev = menu->selected;
+	prevpos = menu->selposition;
 	menu->selected = item;
-	commitdraw(widget, menu, ypos);
-	if (item != NULL && xevent->state & (Button1Mask|Button3Mask)) {
-		while (widget->menus != menu)
-			delmenu(widget);
-		if (openssubmenu(item)) {
-			openitem(widget, item, ypos, false);
-		}
+	schedulepaint(widget, menu, ypos);
+	if (!(xevent->state & (Button1Mask|Button3Mask)))
+		return;
+
+	/*
+	 * While a button is dragged, submenus are opened and closed only
+	 * once the pointer rests on an item, so that sweeping across the
+	 * menu toward an open submenu does not churn through windows.
+	 */
+	if (hover->menu == NULL) {
+		hover->restore = prev;
+		hover->restorepos = prevpos;
+	} else if (item == hover->restore) {
+		hover->menu = NULL;     /* back where the drag started */
+		return;
+	}
+	hover->menu = menu;
+	hover->item = item;
+	hover->ypos = ypos;
+	setdeadline(&hover->settle, aiming ? AIM_TIME : HOVER_TIME);
+	if (item == &scrollup || item == &scrolldown) {
+		/* scrolling moves the rows under the restore position */
+		settlehover(widget);
 	}
 }
 
@@ -2809,8 +4563,8 @@ xproperty(Widget *widget, XEvent *xev)
 	loadresources(widget, str);
 	free(str);
 	for (menu = widget->menus; menu != NULL; menu = menu->next) {
-		drawmenu(widget, menu);
-		commitdraw(widget, menu, menu->selposition);
+		menu->redraw = true;
+		schedulepaint(widget, menu, menu->selposition);
 	}
 }
 
@@ -2818,6 +4572,11 @@ static int
 run(Widget *widget, XRectangle *geometry)
 {
 	XEvent xev;
+	int timeout;
+	struct pollfd pfds[] = {
+		{ .fd = widget->fd,                     .events = POLLIN },
+		{ .fd = widget->loader.pipefd[0],       .events = POLLIN },
+	};
 	static void (*xevents[LASTEvent])(Widget *, XEvent *) = {
 		[ButtonPress]           = xbuttonpress,
 		[ButtonRelease]         = xbuttonrelease,
@@ -2839,10 +4598,34 @@ run(Widget *widget, XRectangle *geometry)
 	getposition(widget, geometry);
 	popupmenu(widget, options.items, geometry, true);
 	while (widget->menus != NULL) {
-		(void)XNextEvent(widget->display, &xev);
-		if (xev.type >= LASTEvent || xevents[xev.type] == NULL)
-			continue;
-		(*xevents[xev.type])(widget, &xev);
+		while (widget->menus != NULL && XPending(widget->display) > 0) {
+			(void)XNextEvent(widget->display, &xev);
+			if (xev.type >= LASTEvent || xevents[xev.type] == NULL)
+				continue;
+			(*xevents[xev.type])(widget, &xev);
+		}
+		if (widget->menus == NULL)
+			break;
+		if (painttimeout(widget) == 0)
+			paintmenus(widget);
+		XFlush(widget->display);
+		timeout = mintimeout(scrolltimeout(widget), painttimeout(widget));
+		timeout = mintimeout(timeout, hovertimeout(widget));
+		if (poll(pfds, LEN(pfds), timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("poll");
+			return RETURN_FAILURE;
+		}
+		if (pfds[1].revents & POLLIN) {
+			loadedicons(widget);
+		}
+		if (hovertimeout(widget) == 0) {
+			settlehover(widget);
+		}
+		if (scrolltimeout(widget) == 0) {
+			scroll(widget);
+		}
 	}
 	return RETURN_SUCCESS;
 }
@@ -2887,6 +4670,7 @@ main(int argc, char *argv[])
 		initvisual,
 		initresources,
 		inittheme,
+		initloader,
 	};
 
 	sa.sa_handler = SIG_IGN;
@@ -2895,6 +4679,7 @@ main(int argc, char *argv[])
 	if (sigaction(SIGCHLD, &sa, NULL) == -1)
 		err(EXIT_FAILURE, "sigaction");
 	parseiconpaths(getenv("ICONPATH"));
+	parsecachedir(getenv("XDG_CACHE_HOME"), getenv("HOME"));
 	parseoptions(argc, argv);
 	if ((options.items = parsestdin()) == NULL) {
 		warnx("no menu generated");
@@ -2914,6 +4699,8 @@ main(int argc, char *argv[])
 error:
 	cleanup(&widget);
 	free(options.iconstring);
+	free(options.cachedir);
+	cleaniconindex();
 	if (options.freetitle)
 		free(options.title);
 	cleanitems(options.items, NULL);